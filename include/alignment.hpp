@@ -13,6 +13,8 @@ enum Alignment : size_t {
     ALIGN_256 = 256,
     ALIGN_512 = 512,
     ALIGN_1024= 1024,
+    ALIGN_2048= 2048,
+    ALIGN_4096= 4096,
     ALIGN_NATURAL = alignof(std::max_align_t)
 };
 
@@ -1,7 +1,88 @@
 #pragma once
 #include "alignment.hpp"
 
+#define MEM_DEFAULT_MMAP_THRESHOLD (128 * 1024)
+#define MEM_DEFAULT_HEAP_GROWTH (64 * 1024)
+#define MEM_DEFAULT_TRIM_THRESHOLD (128 * 1024)
+#define MEM_MAX_HEAPS 64
+#define MEM_HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+//how a thread picks the heap it allocates from
+enum HeapSelect {
+    HEAP_SELECT_CPU,    //the heap of the CPU it is running on
+    HEAP_SELECT_THREAD  //a heap assigned round robin when the thread starts
+};
+
+//Where the heap gets its memory. Both huge page modes grow the heap in 2 MB
+//aligned mappings instead of with sbrk, and back slabs with transparent huge
+//pages, so a large working set needs far fewer TLB entries. Whatever the
+//system cannot give is taken in ordinary pages.
+enum HugePages {
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_MADVISE, //madvise(MADV_HUGEPAGE), used when THP is enabled
+    HUGE_PAGES_HUGETLB  //MAP_HUGETLB from the reserved pool, MADV_HUGEPAGE when it is short
+};
+
+//Runtime tunables, read with mem_get_config and applied with mem_configure
+typedef struct mem_config{
+    //requests of at least this many bytes get a private mapping that is
+    //returned to the OS as soon as they are freed
+    size_t mmap_threshold = MEM_DEFAULT_MMAP_THRESHOLD;
+    //smallest chunk the heap grows by, larger heaps grow geometrically
+    size_t heap_growth_min = MEM_DEFAULT_HEAP_GROWTH;
+    //a free block of at least this many bytes at the end of the heap is
+    //handed back to the OS right away, 0 leaves it all to mem_trim
+    size_t trim_threshold = MEM_DEFAULT_TRIM_THRESHOLD;
+    //number of independent heaps, each with its own lock, 0 means one per
+    //CPU. At most MEM_MAX_HEAPS.
+    size_t heap_count = 0;
+    HeapSelect heap_select = HEAP_SELECT_CPU;
+    //Applies to memory obtained after the call. Slabs reserve their address
+    //range once, on the first small allocation, so set it before that.
+    HugePages huge_pages = HUGE_PAGES_OFF;
+    //Mean bytes allocated between heap profile samples, 0 turns sampling
+    //off. Samples already taken stay until freed, see heap_profile.hpp.
+    size_t profile_sample_rate = 0;
+}mem_config_t;
+
 void* mem_alloc(size_t size);
 void* mem_alloc_align(size_t size, Alignment alignment);
 void* mem_alloc_align_type(size_t size, AlignmentForType type_alignment);
-void mem_free(void* ptr);
\ No newline at end of file
+//count * size zeroed bytes, nullptr when the product overflows. Memory that
+//is still zero from the OS is not cleared again.
+void* mem_calloc(size_t count, size_t size);
+void mem_free(void* ptr);
+//Free with the size, and the alignment, ptr was allocated with, or any size
+//between that and mem_usable_size. Small objects skip the lookup of their
+//size class. Debug builds abort on a size that does not match.
+void mem_free_sized(void* ptr, size_t size);
+void mem_free_aligned_sized(void* ptr, size_t size, Alignment alignment);
+//Allocate count blocks of size bytes under a single heap lock, carved back
+//to back from one free region when there is one. Returns how many were
+//stored in out, fewer than count only when memory ran out.
+size_t mem_alloc_batch(size_t size, size_t count, void** out);
+//Free count blocks with one lock acquisition per owning heap, neighbours
+//are joined before they reach the free lists. nullptr entries are skipped.
+void mem_free_batch(void** ptrs, size_t count);
+//Resize a block, keeping its contents up to the smaller of the two sizes.
+//Heap blocks shrink and grow in place when they can, mapped blocks are
+//resized with mremap. The block is copied only when neither works, then it
+//keeps no alignment beyond ALIGN_NATURAL. Returns nullptr and leaves ptr
+//alone when out of memory, size 0 frees ptr.
+void* mem_realloc(void* ptr, size_t size);
+//bytes that can actually be used behind ptr, at least what was requested
+size_t mem_usable_size(void* ptr);
+
+void mem_configure(const mem_config_t& config);
+mem_config_t mem_get_config();
+
+//number of sbrk/mmap calls made so far to get memory from the OS
+size_t mem_growth_syscalls();
+
+//Return free heap memory to the OS: shrink the break when the end of the
+//heap is free (keeping pad bytes of it) and drop the pages inside large free
+//blocks. Returns the number of bytes released, including what the automatic
+//trim gave back while the call flushed the thread cache.
+size_t mem_trim(size_t pad = 0);
+//bytes released so far, by mem_trim and by the automatic trim
+size_t mem_released_bytes();
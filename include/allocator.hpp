@@ -0,0 +1,65 @@
+#pragma once
+#include "alloc.hpp"
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+namespace memcpp {
+
+//Standard Allocator on top of mem_alloc_align, for std containers
+template<typename T>
+class allocator {
+public:
+    using value_type = T;
+
+    allocator() noexcept = default;
+    template<typename U>
+    allocator(const allocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if(n > std::numeric_limits<size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        void* ptr = mem_alloc_align(n * sizeof(T), static_cast<Alignment>(alignof(T)));
+        if(ptr == nullptr) throw std::bad_alloc();
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, size_t) noexcept {
+        mem_free(ptr);
+    }
+};
+
+//every instance draws from the same heap, so any two compare equal
+template<typename T, typename U>
+bool operator==(const allocator<T>&, const allocator<U>&) noexcept { return true; }
+
+template<typename T, typename U>
+bool operator!=(const allocator<T>&, const allocator<U>&) noexcept { return false; }
+
+//std::pmr adapter, hand it to std::pmr containers
+class memory_resource : public std::pmr::memory_resource {
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        void* ptr = mem_alloc_align(bytes, static_cast<Alignment>(alignment));
+        if(ptr == nullptr) throw std::bad_alloc();
+        return ptr;
+    }
+
+    void do_deallocate(void* ptr, size_t, size_t) override {
+        mem_free(ptr);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return dynamic_cast<const memory_resource*>(&other) != nullptr;
+    }
+};
+
+//process wide instance, like std::pmr::new_delete_resource
+inline memory_resource* get_memory_resource() noexcept {
+    static memory_resource resource;
+    return &resource;
+}
+
+} // namespace memcpp
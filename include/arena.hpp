@@ -0,0 +1,17 @@
+#pragma once
+#include "alignment.hpp"
+
+#define MEM_ARENA_DEFAULT_CHUNK (64 * 1024)
+
+//Region allocator for objects that all die together. Allocation bumps a
+//pointer through chunks taken from the heap, nothing is freed one by one and
+//mem_arena_reset makes every chunk available again in O(1).
+typedef struct mem_arena mem_arena_t;
+
+mem_arena_t* mem_arena_create(size_t chunk_size = MEM_ARENA_DEFAULT_CHUNK);
+void* mem_arena_alloc(mem_arena_t* arena, size_t size);
+void* mem_arena_alloc_align(mem_arena_t* arena, size_t size, Alignment alignment);
+//forget every allocation, the chunks are kept for the next round
+void mem_arena_reset(mem_arena_t* arena);
+//hand every chunk back to the heap
+void mem_arena_destroy(mem_arena_t* arena);
@@ -1,11 +1,81 @@
 #pragma once
 #include <cstddef>
 
+//A block is an 8 byte header followed by its payload. The header holds the
+//size of the whole block, always a multiple of 16, with flags packed into the
+//low bits. Blocks of a heap segment sit back to back, so the next block is
+//found by adding the size, and a zero sized fence block ends each segment.
+//A free block repeats its size in its last word, which lets the block after
+//it step back to it when PREV_FREE is set.
 typedef struct mem_block{
-    bool free;
-    size_t size;
-    bool is_aligned;
-    struct mem_block* next = nullptr;
+    size_t size_flags;
 }mem_block_t;
 
-#define MEM_BLOCK_SIZE sizeof(mem_block_t)
\ No newline at end of file
+#define BLOCK_FREE      ((size_t)0x1)
+#define BLOCK_PREV_FREE ((size_t)0x2)
+#define BLOCK_TRIMMED   ((size_t)0x4) //interior pages of a free block given back
+#define BLOCK_MMAPPED   ((size_t)0x8)
+#define BLOCK_FLAGS     ((size_t)0xF)
+
+//the top byte of the header names the heap that owns the block
+#define BLOCK_HEAP_SHIFT 56
+#define BLOCK_HEAP_MASK ((size_t)0xFF << BLOCK_HEAP_SHIFT)
+
+//free list links, stored in the payload of a free block
+typedef struct mem_free_links{
+    mem_block_t* next;
+    mem_block_t* prev;
+}mem_free_links_t;
+
+#define MEM_BLOCK_SIZE sizeof(mem_block_t)
+//header, free list links and footer
+#define MIN_BLOCK_SIZE (MEM_BLOCK_SIZE + sizeof(mem_free_links_t) + sizeof(size_t))
+#define FREE_LINKS(block) ((mem_free_links_t*)((block) + 1))
+
+inline size_t block_size(const mem_block_t* block){
+    return block->size_flags & ~(BLOCK_FLAGS | BLOCK_HEAP_MASK);
+}
+
+inline size_t block_heap(const mem_block_t* block){
+    return block->size_flags >> BLOCK_HEAP_SHIFT;
+}
+
+inline bool block_is_free(const mem_block_t* block){
+    return (block->size_flags & BLOCK_FREE) != 0;
+}
+
+inline void set_block(mem_block_t* block, size_t size, size_t flags){
+    block->size_flags = size | flags;
+}
+
+inline mem_block_t* block_at(mem_block_t* block, size_t offset){
+    return (mem_block_t*)((char*)block + offset);
+}
+
+inline mem_block_t* next_block(mem_block_t* block){
+    return block_at(block, block_size(block));
+}
+
+//only meaningful while BLOCK_PREV_FREE is set
+inline mem_block_t* prev_block(mem_block_t* block){
+    size_t prev_size = *((size_t*)block - 1);
+    return (mem_block_t*)((char*)block - prev_size);
+}
+
+inline void set_footer(mem_block_t* block){
+    *((size_t*)next_block(block) - 1) = block_size(block);
+}
+
+inline mem_block_t* block_of(void* ptr){
+    return (mem_block_t*)ptr - 1;
+}
+
+inline void* block_payload(mem_block_t* block){
+    return (void*)(block + 1);
+}
+
+//size of the heap block needed to hold size bytes of payload
+inline size_t block_size_for(size_t size){
+    size_t needed = (size + MEM_BLOCK_SIZE + 15) & ~(size_t)15;
+    return needed < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : needed;
+}
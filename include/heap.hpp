@@ -0,0 +1,29 @@
+#pragma once
+#include <cstddef>
+#include "block.hpp"
+
+//Internal interface to the shared heaps. Both calls take a heap lock once for
+//the whole batch, which is what the per-thread caches use to refill and flush.
+//Allocation draws from the calling thread's heap, blocks are freed into the
+//heap that owns them.
+size_t heap_alloc_batch(size_t size, size_t count, void** out);
+void heap_free_batch(void** ptrs, size_t count);
+//index of the calling thread's home heap, slab classes are sharded by it
+size_t heap_shard();
+
+//Callbacks of heap_walk, mmap_walk and slab_walk. They run with a lock held
+//and must not allocate.
+struct heap_visitor{
+    virtual void begin_heap(size_t /*index*/, size_t /*bytes*/){}
+    virtual void begin_segment(mem_block_t* /*first*/){}
+    virtual void block(mem_block_t* /*block*/){}
+    virtual void end_segment(){}
+    virtual void end_heap(){}
+    virtual void mmapped(mem_block_t* /*block*/){}
+    //a slab of SLAB_SIZE bytes holding used objects of object_size
+    virtual void slab(void* /*start*/, size_t /*object_size*/, size_t /*used*/){}
+};
+
+//walk the segments of every heap that has memory, newest segment first
+void heap_walk(heap_visitor& visitor);
+void mmap_walk(heap_visitor& visitor);
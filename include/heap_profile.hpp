@@ -0,0 +1,42 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+//Sampling heap profiler. With mem_config_t::profile_sample_rate set, each
+//thread counts down the bytes it allocates and samples the allocation that
+//crosses zero, then draws the next distance from an exponential distribution
+//with the rate as its mean. An allocation of size bytes is thus sampled with
+//probability 1 - exp(-size / rate), whatever the sizes around it. A sample
+//holds the call stack and stays in the profile until its memory is freed.
+#define MEM_HEAP_PROFILE_DEPTH 32
+
+enum ProfileFormat {
+    PROFILE_PPROF,     //legacy heap_v2 text with the process mappings, for pprof
+    PROFILE_COLLAPSED  //one "outer;...;inner bytes" line per stack, for flame graphs
+};
+
+//Write the samples still live to path. pprof scales the sampled sizes back
+//up by itself, collapsed stacks carry the estimated bytes. Frames are named
+//with dladdr, so functions of the executable need -rdynamic to show up by
+//name. False when the file cannot be written.
+bool mem_heap_profile_dump(const char* path, ProfileFormat format = PROFILE_PPROF);
+
+//The hooks below are all the profiler costs while it is off: one relaxed
+//load and a branch that is never taken.
+
+//mean bytes between samples, 0 while sampling is off
+extern std::atomic<size_t> heap_profile_rate;
+//samples not freed yet, a free only looks its pointer up while there are any
+extern std::atomic<size_t> heap_profile_samples;
+
+void heap_profile_configure(size_t rate);
+void heap_profile_alloc(void* ptr, size_t size);
+void heap_profile_free(void* ptr);
+
+inline void profile_alloc(void* ptr, size_t size){
+    if(heap_profile_rate.load(std::memory_order_relaxed) != 0) [[unlikely]] heap_profile_alloc(ptr, size);
+}
+
+inline void profile_free(void* ptr){
+    if(heap_profile_samples.load(std::memory_order_relaxed) != 0) [[unlikely]] heap_profile_free(ptr);
+}
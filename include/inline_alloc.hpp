@@ -0,0 +1,90 @@
+#pragma once
+#include "alloc.hpp"
+#include "heap_profile.hpp"
+#include "slab.hpp"
+#include "stats.hpp"
+#include "thread_cache.hpp"
+#include "thread_stats.hpp"
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+namespace memcpp {
+
+//slab class of a request known at compile time, NUM_SLAB_CLASSES when a
+//slab cannot take it
+template<size_t N, Alignment A>
+consteval size_t slab_class() {
+    static_assert(A != 0 && (A & (A - 1)) == 0, "alignment must be a power of 2");
+    return slab_class_align(N, A);
+}
+
+//Allocation of N bytes aligned to A, both fixed at compile time. When a slab
+//class takes the request its index, its size and the histogram bucket are
+//constants, and a hit in the thread cache is inlined into the caller. A miss
+//and every larger request go through mem_alloc or mem_alloc_align. The
+//default alignment is the one mem_alloc gives.
+template<size_t N, Alignment A = ALIGN_8>
+inline void* alloc() {
+    constexpr size_t class_index = slab_class<N, A>();
+    if constexpr(class_index < NUM_SLAB_CLASSES) {
+        //a thread whose counters are not registered yet takes the slow path
+        //once, while the heap is profiled every call does
+        if(mem_thread_stats.active && heap_profile_rate.load(std::memory_order_relaxed) == 0) {
+            void* ptr = tcache_slab_pop(class_index);
+            if(ptr != nullptr) {
+                stats_add(mem_thread_stats.allocated_bytes, slab_class_size(class_index));
+                stats_add(mem_thread_stats.histogram[mem_stats_bucket(N)], 1);
+                return ptr;
+            }
+        }
+    }
+    if constexpr(A <= ALIGN_8) return mem_alloc(N);
+    else return mem_alloc_align(N, A);
+}
+
+//Free memory from alloc<N, A>, or from any call with the same size and
+//alignment. Like mem_free_aligned_sized, debug builds check the size.
+template<size_t N, Alignment A = ALIGN_8>
+inline void dealloc(void* ptr) {
+    constexpr size_t class_index = slab_class<N, A>();
+    if constexpr(class_index < NUM_SLAB_CLASSES) {
+        //while heap profile samples are live the object may be one of them
+        if(slab_contains(ptr) && mem_thread_stats.active
+           && heap_profile_samples.load(std::memory_order_relaxed) == 0) {
+            assert(slab_class_of(ptr) == class_index && "size does not match the allocation");
+            if(tcache_slab_push(ptr, class_index)) {
+                stats_add(mem_thread_stats.frees, 1);
+                stats_add(mem_thread_stats.freed_bytes, slab_class_size(class_index));
+                return;
+            }
+        }
+    }
+    mem_free_aligned_sized(ptr, N, A);
+}
+
+//Construct a T in memory from alloc. nullptr when the heap is exhausted,
+//the memory is given back when the constructor throws.
+template<typename T, typename... Args>
+inline T* make(Args&&... args) {
+    constexpr Alignment align = static_cast<Alignment>(alignof(T));
+    void* mem = alloc<sizeof(T), align>();
+    if(mem == nullptr) return nullptr;
+    try {
+        return new (mem) T(std::forward<Args>(args)...);
+    } catch(...) {
+        dealloc<sizeof(T), align>(mem);
+        throw;
+    }
+}
+
+//obj must have been made as a T, not as a class derived from it
+template<typename T>
+inline void destroy(T* obj) {
+    if(obj == nullptr) return;
+    obj->~T();
+    dealloc<sizeof(T), static_cast<Alignment>(alignof(T))>(obj);
+}
+
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include "alloc.hpp"
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <utility>
+
+namespace memcpp {
+
+//Pool of same sized objects. Slabs are taken from mem_alloc_align with the
+//alignment of T and carved into slots on demand. Free slots are chained
+//through their own storage, so a live object carries no header at all.
+//Slabs are only returned to the heap when the pool is destroyed.
+template<typename T>
+class object_pool {
+public:
+    explicit object_pool(size_t objects_per_slab = 256)
+        : objects_per_slab_(objects_per_slab ? objects_per_slab : 1) {}
+
+    ~object_pool() {
+        while(slabs_ != nullptr) {
+            slab* next = slabs_->next;
+            mem_free(slabs_);
+            slabs_ = next;
+        }
+    }
+
+    object_pool(const object_pool&) = delete;
+    object_pool& operator=(const object_pool&) = delete;
+
+    //uninitialised storage for one T, nullptr when the heap is exhausted
+    void* allocate() {
+        if(free_list_ != nullptr) {
+            slot* s = free_list_;
+            free_list_ = s->next;
+            return s;
+        }
+        if(bump_ == bump_end_ && !add_slab()) return nullptr;
+        return bump_++;
+    }
+
+    void deallocate(void* ptr) {
+        if(ptr == nullptr) return;
+        slot* s = static_cast<slot*>(ptr);
+        s->next = free_list_;
+        free_list_ = s;
+    }
+
+    template<typename... Args>
+    T* create(Args&&... args) {
+        void* mem = allocate();
+        if(mem == nullptr) return nullptr;
+        return new (mem) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T* obj) {
+        if(obj == nullptr) return;
+        obj->~T();
+        deallocate(obj);
+    }
+
+private:
+    union slot {
+        slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    struct slab {
+        slab* next;
+    };
+
+    //slot storage starts at the first slot aligned offset past the header
+    static constexpr size_t slab_header_size =
+        (sizeof(slab) + alignof(slot) - 1) & ~(alignof(slot) - 1);
+
+    bool add_slab() {
+        size_t bytes = slab_header_size + objects_per_slab_ * sizeof(slot);
+        Alignment alignment = static_cast<Alignment>(
+            alignof(slot) > alignof(slab) ? alignof(slot) : alignof(slab));
+        slab* s = static_cast<slab*>(mem_alloc_align(bytes, alignment));
+        if(s == nullptr) return false;
+
+        s->next = slabs_;
+        slabs_ = s;
+        bump_ = reinterpret_cast<slot*>(reinterpret_cast<char*>(s) + slab_header_size);
+        bump_end_ = bump_ + objects_per_slab_;
+        return true;
+    }
+
+    size_t objects_per_slab_;
+    slab* slabs_ = nullptr;
+    slot* free_list_ = nullptr;
+    slot* bump_ = nullptr;
+    slot* bump_end_ = nullptr;
+};
+
+//object_pool guarded by a mutex, for pools shared between threads
+template<typename T>
+class concurrent_object_pool {
+public:
+    explicit concurrent_object_pool(size_t objects_per_slab = 256)
+        : pool_(objects_per_slab) {}
+
+    void* allocate() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return pool_.allocate();
+    }
+
+    void deallocate(void* ptr) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pool_.deallocate(ptr);
+    }
+
+    template<typename... Args>
+    T* create(Args&&... args) {
+        void* mem = allocate();
+        if(mem == nullptr) return nullptr;
+        return new (mem) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T* obj) {
+        if(obj == nullptr) return;
+        obj->~T();
+        deallocate(obj);
+    }
+
+private:
+    object_pool<T> pool_;
+    std::mutex mutex_;
+};
+
+} // namespace memcpp
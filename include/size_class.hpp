@@ -0,0 +1,26 @@
+#pragma once
+#include <cstddef>
+#include "block.hpp"
+
+//Small requests are rounded up to a size class so that freed blocks of the
+//same class are interchangeable. Classes step by the block granule, the size
+//of a class is the payload left after the block header.
+#define SIZE_CLASS_GRANULE 16
+#define SIZE_CLASS_MAX_BLOCK 1024
+#define SIZE_CLASS_MAX (SIZE_CLASS_MAX_BLOCK - MEM_BLOCK_SIZE)
+#define NUM_SIZE_CLASSES (SIZE_CLASS_MAX_BLOCK / SIZE_CLASS_GRANULE - 1)
+
+//smallest class able to hold size bytes
+constexpr size_t size_class_index(size_t size){
+    size_t blocks = (size + MEM_BLOCK_SIZE + SIZE_CLASS_GRANULE - 1) / SIZE_CLASS_GRANULE;
+    return blocks < 2 ? 0 : blocks - 2;
+}
+
+//largest class that size usable bytes can serve
+constexpr size_t size_class_index_floor(size_t size){
+    return (size + MEM_BLOCK_SIZE) / SIZE_CLASS_GRANULE - 2;
+}
+
+constexpr size_t size_class_size(size_t index){
+    return (index + 2) * SIZE_CLASS_GRANULE - MEM_BLOCK_SIZE;
+}
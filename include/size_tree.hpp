@@ -0,0 +1,23 @@
+#pragma once
+#include <cstddef>
+#include "block.hpp"
+
+//Each shared bin of a heap keeps its free blocks in an AVL tree ordered by
+//size, then by address, so every key is unique and a best fit is found in
+//O(log n). Of several blocks of the best size the lowest one wins, which
+//keeps allocations packed towards the start of the heap. The links live in
+//the payload of the free block, in place of its free list links.
+typedef struct mem_tree_links{
+    mem_block_t* left;
+    mem_block_t* right;
+    size_t height;
+}mem_tree_links_t;
+
+#define TREE_LINKS(block) ((mem_tree_links_t*)((block) + 1))
+
+//The size of a block must not change while it is in the tree, take it out
+//first. root is nullptr for an empty tree.
+void tree_insert(mem_block_t** root, mem_block_t* block);
+void tree_remove(mem_block_t** root, mem_block_t* block);
+//smallest block of at least size bytes, nullptr when there is none
+mem_block_t* tree_best_fit(mem_block_t* root, size_t size);
@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "heap.hpp"
+
+//Requests of up to SLAB_MAX_SIZE bytes are served from slabs, SLAB_SIZE
+//runs of equal objects with no header in front of them. Every size class
+//owns a fixed slice of one reserved address range, so the class of a pointer
+//follows from its address alone. The start of each slice holds a flat array
+//of slab descriptors, the page map, indexed by the slab's offset in it.
+#define SLAB_SHIFT 16
+#define SLAB_SIZE ((size_t)1 << SLAB_SHIFT)
+#define SLAB_MAX_SIZE 128
+#define SLAB_GRANULE 8
+#define NUM_SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_GRANULE)
+#define SLAB_CLASS_SHIFT 31 //2 GB of address space per class
+
+//where the slices start, slab_span stays 0 until the range is reserved
+extern std::atomic<uintptr_t> slab_base;
+extern std::atomic<uintptr_t> slab_span;
+
+//Classes step by 8 bytes. An object whose size is not a multiple of 16
+//cannot need more than 8 byte alignment, the others land on 16 bytes.
+constexpr size_t slab_class_index(size_t size){
+    return size <= SLAB_GRANULE ? 0 : (size + SLAB_GRANULE - 1) / SLAB_GRANULE - 1;
+}
+
+constexpr size_t slab_class_size(size_t index){
+    return (index + 1) * SLAB_GRANULE;
+}
+
+//Slabs start on a page, so every object of a class whose size is a
+//multiple of align_val is aligned. The slab class of an aligned request is
+//the one its size rounds up to, NUM_SLAB_CLASSES when there is none.
+constexpr size_t slab_class_align(size_t size, size_t align_val){
+    if(size > SLAB_MAX_SIZE || align_val > SLAB_MAX_SIZE) return NUM_SLAB_CLASSES;
+    size_t rounded = ((size == 0 ? 1 : size) + align_val - 1) & ~(align_val - 1);
+    return rounded <= SLAB_MAX_SIZE ? slab_class_index(rounded) : NUM_SLAB_CLASSES;
+}
+
+inline bool slab_contains(const void* ptr){
+    return reinterpret_cast<uintptr_t>(ptr) - slab_base.load(std::memory_order_relaxed)
+           < slab_span.load(std::memory_order_relaxed);
+}
+
+//only meaningful when slab_contains(ptr)
+inline size_t slab_class_of(const void* ptr){
+    return (reinterpret_cast<uintptr_t>(ptr) - slab_base.load(std::memory_order_relaxed)) >> SLAB_CLASS_SHIFT;
+}
+
+//Both take a shard lock of the class once for the whole batch, like
+//heap_alloc_batch and heap_free_batch do for heap blocks. slab_alloc_batch
+//returns 0 when the address range could not be reserved, callers fall back
+//to the heap.
+size_t slab_alloc_batch(size_t class_index, size_t count, void** out);
+//ptrs may mix classes, runs of one class and shard share a lock acquisition
+void slab_free_batch(void** ptrs, size_t count);
+//give the pages of empty slabs back to the OS, returns the bytes released
+size_t slab_trim();
+void slab_walk(heap_visitor& visitor);
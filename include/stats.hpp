@@ -0,0 +1,51 @@
+#pragma once
+#include <cstddef>
+#include "size_class.hpp"
+
+//Allocation counts by requested size: one bucket per small size class, then
+//one per power of two above SIZE_CLASS_MAX_BLOCK, the last one is open ended.
+#define MEM_STATS_LARGE_BUCKETS 32
+#define MEM_STATS_BUCKETS (NUM_SIZE_CLASSES + MEM_STATS_LARGE_BUCKETS)
+
+typedef struct mem_stats{
+    size_t bytes_in_use;       //usable bytes of live allocations
+    size_t bytes_free;         //usable bytes of free heap blocks
+    size_t block_count;        //heap blocks, used and free, plus mmapped blocks
+    size_t free_block_count;
+    size_t largest_free_block; //usable bytes
+    double fragmentation;      //1 - largest_free_block / bytes_free
+    size_t heap_bytes;         //obtained from the OS with sbrk or as huge page regions
+    size_t mmap_bytes;         //mapped for large blocks
+    size_t slab_bytes;         //backing slabs of small objects, used or not
+    size_t growth_syscalls;
+    size_t released_bytes;
+    size_t allocations;
+    size_t frees;
+    size_t histogram[MEM_STATS_BUCKETS];
+}mem_stats_t;
+
+enum DumpFormat {
+    DUMP_TEXT,
+    DUMP_JSON
+};
+
+//Counters are kept per thread and only added up here. The heap figures come
+//from a walk of every heap, one heap at a time under its lock. Blocks parked
+//in thread caches count as in use by the heap but not by the program. Slab
+//objects are not blocks, they only show in slab_bytes.
+mem_stats_t mem_stats();
+//write every block of every heap and every mmapped block to fd
+void mem_dump_heap(int fd, DumpFormat format = DUMP_TEXT);
+
+constexpr size_t mem_stats_bucket(size_t size){
+    if(size <= SIZE_CLASS_MAX) return size_class_index(size);
+    size_t log = 64 - __builtin_clzll(size - 1) - __builtin_ctzll(SIZE_CLASS_MAX_BLOCK);
+    return NUM_SIZE_CLASSES + (log < MEM_STATS_LARGE_BUCKETS ? log : MEM_STATS_LARGE_BUCKETS - 1);
+}
+
+//largest request counted in a bucket
+constexpr size_t mem_stats_bucket_limit(size_t bucket){
+    if(bucket < NUM_SIZE_CLASSES) return size_class_size(bucket);
+    if(bucket == MEM_STATS_BUCKETS - 1) return (size_t)-1;
+    return (size_t)SIZE_CLASS_MAX_BLOCK << (bucket - NUM_SIZE_CLASSES);
+}
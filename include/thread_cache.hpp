@@ -0,0 +1,76 @@
+#pragma once
+#include "size_class.hpp"
+#include "slab.hpp"
+#include <cstddef>
+
+#define TCACHE_BIN_CAPACITY 64
+
+//lives in the payload of a cached block
+typedef struct tcache_entry{
+    struct tcache_entry* next;
+    void* key; //owning cache, used to catch double frees, absent in 8 byte objects
+}tcache_entry_t;
+
+typedef struct tcache_bin{
+    tcache_entry_t* head = nullptr;
+    size_t count = 0;
+}tcache_bin_t;
+
+enum TcacheState { TCACHE_UNREGISTERED, TCACHE_ACTIVE, TCACHE_EXITED };
+
+//Trivially destructible on purpose: a thread_local with a destructor is
+//registered through __cxa_thread_atexit, which allocates and would recurse
+//into us when we stand in for malloc. The flush on thread exit hangs off a
+//pthread key instead, set the first time the cache holds a block.
+struct thread_cache{
+    tcache_bin_t bins[NUM_SIZE_CLASSES];
+    tcache_bin_t slab_bins[NUM_SLAB_CLASSES];
+    TcacheState state = TCACHE_UNREGISTERED;
+};
+
+//The calling thread's cache. constinit lets code outside thread_cache.cpp
+//reach it directly, without the call to a TLS init wrapper.
+extern constinit thread_local thread_cache mem_tcache;
+
+//Per-thread caches of recently freed small blocks, one bin per size class.
+//A hit in either call never touches the shared heap lock.
+void* tcache_alloc(size_t class_index);
+//only hits when the head of the bin happens to be align_val aligned
+void* tcache_alloc_aligned(size_t class_index, size_t align_val);
+void tcache_free(void* ptr, size_t class_index);
+//the same for slab objects, nullptr when no slab could be had
+void* tcache_slab_alloc(size_t class_index);
+void tcache_slab_free(void* ptr, size_t class_index);
+//give every block cached by the calling thread back to the heap
+void tcache_flush_all();
+
+//objects of the smallest slab class have no room for the key
+constexpr bool tcache_slab_keyed(size_t class_index){
+    return slab_class_size(class_index) >= sizeof(tcache_entry_t);
+}
+
+//The hits of tcache_slab_alloc and tcache_slab_free, inlined where the
+//class is known at compile time. nullptr and false leave everything else,
+//refills, flushes and suspected double frees, to the calls above.
+inline void* tcache_slab_pop(size_t class_index){
+    tcache_bin_t* bin = &mem_tcache.slab_bins[class_index];
+    tcache_entry_t* entry = bin->head;
+    if(entry == nullptr) return nullptr;
+    bin->head = entry->next;
+    bin->count--;
+    if(tcache_slab_keyed(class_index)) entry->key = nullptr;
+    return entry;
+}
+
+inline bool tcache_slab_push(void* ptr, size_t class_index){
+    tcache_bin_t* bin = &mem_tcache.slab_bins[class_index];
+    if(mem_tcache.state != TCACHE_ACTIVE || bin->count >= TCACHE_BIN_CAPACITY) return false;
+    tcache_entry_t* entry = (tcache_entry_t*)ptr;
+    bool keyed = tcache_slab_keyed(class_index);
+    if(keyed ? entry->key == &mem_tcache : bin->head == entry) return false;
+    entry->next = bin->head;
+    if(keyed) entry->key = &mem_tcache;
+    bin->head = entry;
+    bin->count++;
+    return true;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "stats.hpp"
+#include <atomic>
+
+//Counters of one thread. Only the owning thread writes them, mem_stats reads
+//them from any thread, so a relaxed load and store is all an update needs.
+//The number of allocations is the sum of the histogram.
+typedef struct mem_thread_stats{
+    std::atomic<size_t> frees;
+    std::atomic<size_t> allocated_bytes;
+    std::atomic<size_t> freed_bytes;
+    std::atomic<size_t> histogram[MEM_STATS_BUCKETS];
+    //initialised so a thread_local instance needs no guard
+    bool active = false;  //in the registry read by mem_stats
+    bool retired = false; //the thread is exiting, its counts were folded away
+    struct mem_thread_stats* prev = nullptr;
+    struct mem_thread_stats* next = nullptr;
+}mem_thread_stats_t;
+
+//the calling thread's counters, constinit for the same reason as mem_tcache
+extern constinit thread_local mem_thread_stats_t mem_thread_stats;
+
+inline void stats_add(std::atomic<size_t>& counter, size_t n){
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+//Put a thread's counters in the registry on its first allocation. Returns
+//false once the thread is exiting.
+bool stats_attach(mem_thread_stats_t* stats);
+//counted for a thread whose counters are gone, usually frees from
+//thread_local destructors that run late
+void stats_record_retired_alloc(size_t size, size_t usable);
+void stats_record_retired_free(size_t usable);
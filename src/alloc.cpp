@@ -1,27 +1,951 @@
 #include "../include/alloc.hpp"
 #include "../include/block.hpp"
+#include "../include/heap.hpp"
+#include "../include/heap_profile.hpp"
+#include "../include/size_tree.hpp"
+#include "../include/slab.hpp"
+#include "../include/thread_cache.hpp"
+#include "../include/thread_stats.hpp"
 #include <cstddef>
+#include <cstdint>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <atomic>
 #include <memory>
 #include <mutex>
 #include <cassert>
+#include <cstring>
 
-#define INITIAL_BLOCK_SIZE  1024
-#define STARTING_SIZE INITIAL_BLOCK_SIZE+MEM_BLOCK_SIZE
+//the heap grows by its own size, clamped between heap_growth_min and this
+#define MAX_HEAP_GROWTH (16 * 1024 * 1024)
 
-mem_block_t* head = nullptr;
-std::mutex alloc_mutex;
+#define NUM_SMALL_BINS NUM_SIZE_CLASSES
+#define LOG2_SIZE_CLASS_MAX_BLOCK 10
+#define BINS_PER_POWER 4
+#define NUM_BINS 128
+//remote frees a heap may hold before the pusher drains them itself
+#define REMOTE_DRAIN_BYTES (256 * 1024)
 
-void init_mem_pool() {
-    head = (mem_block_t*) sbrk(STARTING_SIZE);
-    if(head == (void*) -1) {
-        head = nullptr; // sbrk failed
+//The heap is split into independent shards, each with its own segments,
+//bins and lock. A block's header records the heap it was carved from so it
+//is always freed back there, whichever thread frees it. Other threads do not
+//take the lock for that, they push the block onto remote_frees and whoever
+//locks the heap next drains the list.
+typedef struct alignas(64) mem_heap{
+    std::mutex mutex;
+    mem_block_t* top;            //fence ending the most recent segment
+    mem_block_t* segments;       //first block of the newest segment
+    bool top_mapped;             //the newest segment is a mapping, not sbrk memory
+    mem_block_t* bins[NUM_BINS];
+    uint64_t bin_bitmap[NUM_BINS / 64];
+    size_t bytes;                //obtained from the OS
+    //Nothing at or past this address in the newest segment was handed out
+    //since the OS gave it to us, so it still reads zero except for the bin
+    //links at the start of the block and the footer at its end
+    char* untouched;
+    alignas(64) std::atomic<mem_block_t*> remote_frees; //linked through FREE_LINKS
+    std::atomic<size_t> remote_bytes;                    //block bytes on remote_frees
+}mem_heap_t;
+
+mem_heap_t heaps[MEM_MAX_HEAPS];
+std::atomic<size_t> heap_count{0};
+std::atomic<HeapSelect> heap_select{HEAP_SELECT_CPU};
+std::atomic<size_t> next_thread_heap{0};
+static thread_local size_t thread_heap = SIZE_MAX;
+//heaps share the program break
+std::mutex sbrk_mutex;
+constinit thread_local mem_thread_stats_t mem_thread_stats;
+std::atomic<size_t> heap_growth_min{MEM_DEFAULT_HEAP_GROWTH};
+std::atomic<size_t> growth_syscalls{0};
+std::atomic<size_t> trim_threshold{MEM_DEFAULT_TRIM_THRESHOLD};
+std::atomic<size_t> released_bytes{0};
+std::atomic<HugePages> huge_pages{HUGE_PAGES_OFF};
+
+//bytes of a payload known to read zero
+typedef struct mem_zeroed{
+    char* start;
+    char* end;
+}mem_zeroed_t;
+
+//A trimmed block records the pages it gave back past its bin links. They are
+//whole huge pages when trimmed in huge page mode, so they cannot be worked
+//out again from the block's bounds.
+#define TRIMMED_PAGES(block) ((mem_zeroed_t*)(TREE_LINKS(block) + 1))
+
+//Large blocks live in their own mappings, on a list separate from the heap.
+//The chunk prefix keeps the payload 16 byte aligned, the header's size field
+//holds the length of the mapping, which starts offset bytes before the chunk.
+typedef struct mem_mmap_chunk{
+    struct mem_mmap_chunk* prev;
+    struct mem_mmap_chunk* next;
+    size_t offset;
+    mem_block_t block;
+}mem_mmap_chunk_t;
+
+mem_mmap_chunk_t* mmap_head = nullptr;
+std::mutex mmap_mutex;
+std::atomic<size_t> mmap_threshold{MEM_DEFAULT_MMAP_THRESHOLD};
+
+//sbrk wrapper that keeps every segment 16 byte aligned, the break may
+//have been moved by someone else to an odd address
+static void* heap_sbrk(size_t size) {
+    std::lock_guard<std::mutex> lock(sbrk_mutex);
+    uintptr_t brk = reinterpret_cast<uintptr_t>(sbrk(0));
+    size_t padding = align_size(brk, ALIGN_16) - brk;
+    char* mem = (char*) sbrk(padding + size);
+    if(mem == (void*) -1) return mem;
+    return mem + padding;
+}
+
+//Map a 2 MB aligned region of length bytes, a multiple of MEM_HUGE_PAGE_SIZE,
+//to grow a heap by. MAP_HUGETLB fails unless the pool holds enough pages,
+//then, as under HUGE_PAGES_MADVISE, the region is ordinary memory that asks
+//for transparent huge pages. (void*)-1 on failure, like heap_sbrk.
+static void* heap_region(size_t length, HugePages mode){
+    if(mode == HUGE_PAGES_HUGETLB){
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_2MB
+        flags |= MAP_HUGE_2MB;
+#endif
+        void* mem = mmap(nullptr, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if(mem != MAP_FAILED) return mem;
+    }
+
+    //over-map by a huge page and cut the unaligned ends off
+    size_t span = length + MEM_HUGE_PAGE_SIZE;
+    char* mem = (char*)mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED) return (void*) -1;
+    char* start = (char*)((reinterpret_cast<uintptr_t>(mem) + MEM_HUGE_PAGE_SIZE - 1) & ~(MEM_HUGE_PAGE_SIZE - 1));
+    if(start > mem) munmap(mem, start - mem);
+    if(start + length < mem + span) munmap(start + length, mem + span - (start + length));
+    //fails harmlessly where THP is disabled, the pages stay small
+    madvise(start, length, MADV_HUGEPAGE);
+    return start;
+}
+
+static size_t heap_tag(mem_heap_t* heap){
+    return (size_t)(heap - heaps) << BLOCK_HEAP_SHIFT;
+}
+
+//number of heaps in use, resolved to one per CPU on first use
+static size_t active_heaps(){
+    size_t count = heap_count.load(std::memory_order_relaxed);
+    if(count != 0) return count;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    count = cpus < 1 ? 1 : (size_t)cpus;
+    if(count > MEM_MAX_HEAPS) count = MEM_MAX_HEAPS;
+    heap_count.store(count, std::memory_order_relaxed);
+    return count;
+}
+
+static size_t home_heap(size_t count){
+    if(heap_select.load(std::memory_order_relaxed) == HEAP_SELECT_CPU){
+        int cpu = sched_getcpu();
+        if(cpu >= 0) return (size_t)cpu % count;
+    }
+    if(thread_heap == SIZE_MAX){
+        thread_heap = next_thread_heap.fetch_add(1, std::memory_order_relaxed);
+    }
+    return thread_heap % count;
+}
+
+size_t heap_shard(){
+    size_t count = active_heaps();
+    return count == 1 ? 0 : home_heap(count);
+}
+
+//Lock the calling thread's heap. When another thread holds it, any other heap
+//that is free right now will do, only if all are busy do we wait for our own.
+static mem_heap_t* try_lock_heaps(){
+    size_t count = active_heaps();
+    size_t home = count == 1 ? 0 : home_heap(count);
+    if(heaps[home].mutex.try_lock()) return &heaps[home];
+
+    for(size_t i = 1; i < count; i++){
+        size_t index = home + i < count ? home + i : home + i - count;
+        if(heaps[index].mutex.try_lock()) return &heaps[index];
+    }
+    heaps[home].mutex.lock();
+    return &heaps[home];
+}
+
+//Decide whether a block freed by this thread can go straight into its heap.
+//True with the heap locked, false when the block belongs to another thread's
+//heap or the lock is busy, the caller then pushes it to remote_frees.
+static bool lock_owner(mem_heap_t* heap){
+    size_t count = active_heaps();
+    size_t index = (size_t)(heap - heaps);
+    if(index >= count){
+        //nobody allocates from it anymore, so nobody would drain it
+        heap->mutex.lock();
+        return true;
+    }
+    if(count > 1 && index != home_heap(count)) return false;
+    return heap->mutex.try_lock();
+}
+
+//Push a chain of blocks linked through their free links onto the heap's
+//remote free list. Lock free, any number of threads may push at once.
+static void remote_push(mem_heap_t* heap, mem_block_t* first, mem_block_t* last){
+    mem_block_t* head = heap->remote_frees.load(std::memory_order_relaxed);
+    do{
+        FREE_LINKS(last)->next = head;
+    }while(!heap->remote_frees.compare_exchange_weak(head, first, std::memory_order_release,
+                                                     std::memory_order_relaxed));
+}
+
+//Free blocks are kept in segregated bins. Blocks up to SIZE_CLASS_MAX_BLOCK
+//get one exact bin per size class, larger blocks share logarithmic bins with
+//four sub-bins per power of two. A bitmap of non-empty bins lets a lookup
+//jump straight to the first bin that can hold the request. An exact bin is
+//a list, a shared bin is a size tree, so the block taken from it is the
+//best fit rather than the first one that happens to be large enough.
+static size_t bin_index(size_t size){
+    if(size <= SIZE_CLASS_MAX_BLOCK) return size / SIZE_CLASS_GRANULE - 2;
+    size_t log = 63 - __builtin_clzll(size);
+    size_t index = NUM_SMALL_BINS + (log - LOG2_SIZE_CLASS_MAX_BLOCK) * BINS_PER_POWER
+                   + ((size >> (log - 2)) & (BINS_PER_POWER - 1));
+    return index < NUM_BINS ? index : NUM_BINS - 1;
+}
+
+static void bin_insert(mem_heap_t* heap, mem_block_t* block){
+    size_t index = bin_index(block_size(block));
+    heap->bin_bitmap[index / 64] |= 1ull << (index % 64);
+    if(index >= NUM_SMALL_BINS){
+        tree_insert(&heap->bins[index], block);
+        return;
+    }
+    mem_free_links_t* links = FREE_LINKS(block);
+    links->prev = nullptr;
+    links->next = heap->bins[index];
+    if(heap->bins[index] != nullptr) FREE_LINKS(heap->bins[index])->prev = block;
+    heap->bins[index] = block;
+}
+
+static void bin_remove(mem_heap_t* heap, mem_block_t* block){
+    size_t index = bin_index(block_size(block));
+    if(index >= NUM_SMALL_BINS){
+        tree_remove(&heap->bins[index], block);
+    }else{
+        mem_free_links_t* links = FREE_LINKS(block);
+        if(links->prev != nullptr) FREE_LINKS(links->prev)->next = links->next;
+        else heap->bins[index] = links->next;
+        if(links->next != nullptr) FREE_LINKS(links->next)->prev = links->prev;
+    }
+    if(heap->bins[index] == nullptr) heap->bin_bitmap[index / 64] &= ~(1ull << (index % 64));
+}
+
+//first non-empty bin at or after index, NUM_BINS if there is none
+static size_t next_bin(mem_heap_t* heap, size_t index){
+    for(size_t word = index / 64; word < NUM_BINS / 64; word++){
+        uint64_t bits = heap->bin_bitmap[word];
+        if(word == index / 64) bits &= ~0ull << (index % 64);
+        if(bits != 0) return word * 64 + __builtin_ctzll(bits);
+    }
+    return NUM_BINS;
+}
+
+static mem_block_t* bin_find(mem_heap_t* heap, size_t size){
+    size_t index = bin_index(size);
+
+    //exact small bins always fit, shared bins may hold smaller blocks
+    if(index >= NUM_SMALL_BINS){
+        mem_block_t* fit = tree_best_fit(heap->bins[index], size);
+        if(fit != nullptr) return fit;
+        index++;
+    }
+    //every block of a later bin fits, the best one is its smallest
+    index = next_bin(heap, index);
+    if(index >= NUM_BINS) return nullptr;
+    return index < NUM_SMALL_BINS ? heap->bins[index] : tree_best_fit(heap->bins[index], size);
+}
+
+//mark a free block (already out of its bin) as used, keeping only size
+//bytes of it. The rest goes back to the bins when it is big enough.
+static void use_block(mem_heap_t* heap, mem_block_t* block, size_t size){
+    size_t remaining_size = block_size(block) - size;
+    if(remaining_size < MIN_BLOCK_SIZE){
+        //Not enough space to split, allocate entire block
+        block->size_flags &= ~(BLOCK_FREE | BLOCK_TRIMMED);
+        next_block(block)->size_flags &= ~BLOCK_PREV_FREE;
+        return;
+    }
+
+    //Large enough to split, the block after the remainder keeps PREV_FREE.
+    //A trimmed remainder keeps the trimmed pages past its own record.
+    size_t trimmed = block->size_flags & BLOCK_TRIMMED;
+    mem_zeroed_t pages = {nullptr, nullptr};
+    if(trimmed) pages = *TRIMMED_PAGES(block);
+    set_block(block, size, (block->size_flags & BLOCK_PREV_FREE) | heap_tag(heap));
+    mem_block_t* new_block = block_at(block, size);
+    if(trimmed){
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        char* first = (char*)align_size(reinterpret_cast<uintptr_t>(TRIMMED_PAGES(new_block) + 1), (Alignment)page_size);
+        if(first >= pages.end) trimmed = 0;
+        else if(first > pages.start) pages.start = first;
+    }
+    set_block(new_block, remaining_size, BLOCK_FREE | trimmed | heap_tag(heap));
+    if(trimmed) *TRIMMED_PAGES(new_block) = pages;
+    set_footer(new_block);
+    bin_insert(heap, new_block);
+}
+
+//Grow the heap by a chunk large enough for a block of size bytes. The chunk
+//is returned as one free block that is not in any bin yet, whatever the
+//caller does not use goes back to the free lists when it is split.
+static mem_block_t* heap_grow(mem_heap_t* heap, size_t size){
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    //room for a leading pad word and the fence of a new segment
+    size_t needed = size + 2 * MEM_BLOCK_SIZE;
+    size_t chunk = heap->bytes < MAX_HEAP_GROWTH ? heap->bytes : MAX_HEAP_GROWTH;
+    size_t growth_min = heap_growth_min.load(std::memory_order_relaxed);
+    if(chunk < growth_min) chunk = growth_min;
+    if(chunk < needed) chunk = needed;
+    HugePages mode = huge_pages.load(std::memory_order_relaxed);
+    char* mem;
+    if(mode != HUGE_PAGES_OFF){
+        chunk = (chunk + MEM_HUGE_PAGE_SIZE - 1) & ~(MEM_HUGE_PAGE_SIZE - 1);
+        mem = (char*) heap_region(chunk, mode);
+        if(mem == (void*) -1 && chunk > needed) {
+            chunk = (needed + MEM_HUGE_PAGE_SIZE - 1) & ~(MEM_HUGE_PAGE_SIZE - 1);
+            mem = (char*) heap_region(chunk, mode);
+        }
+    }else{
+        chunk = (chunk + page_size - 1) & ~(page_size - 1);
+        mem = (char*) heap_sbrk(chunk);
+        if(mem == (void*) -1 && chunk > needed) {
+            //could not get the whole chunk, settle for the request itself
+            chunk = align_size(needed, ALIGN_16);
+            mem = (char*) heap_sbrk(chunk);
+        }
+    }
+    if(mem == (void*) -1) {
+        return nullptr; //sbrk failed
+    }
+    growth_syscalls.fetch_add(1, std::memory_order_relaxed);
+    heap->bytes += chunk;
+
+    mem_block_t* block;
+    size_t block_bytes;
+    size_t flags;
+    if(heap->top != nullptr && (char*)(heap->top + 1) == mem) {
+        //nobody moved the break since our last growth, the old fence
+        //becomes the header of the new space
+        block = heap->top;
+        block_bytes = chunk;
+        flags = heap->top->size_flags & BLOCK_PREV_FREE;
+    } else {
+        //new segment, payloads need the header at 8 mod 16. The pad word
+        //in front links to the previous segment.
+        block = (mem_block_t*)(mem + MEM_BLOCK_SIZE);
+        block_bytes = chunk - 2 * MEM_BLOCK_SIZE;
+        flags = 0;
+        *(mem_block_t**)mem = heap->segments;
+        heap->segments = block;
+        heap->untouched = (char*)block;
+    }
+    heap->top_mapped = mode != HUGE_PAGES_OFF;
+    heap->top = block_at(block, block_bytes);
+    set_block(heap->top, 0, BLOCK_PREV_FREE | heap_tag(heap));
+
+    //merge with a free block at the end of the previous space
+    if(flags & BLOCK_PREV_FREE) {
+        //the old fence and the footer before it end up inside the block
+        mem_block_t* prev = prev_block(block);
+        *((size_t*)block - 1) = 0;
+        block->size_flags = 0;
+        bin_remove(heap, prev);
+        block_bytes += block_size(prev);
+        block = prev;
+    }
+    set_block(block, block_bytes, BLOCK_FREE | heap_tag(heap));
+    set_footer(block);
+    return block;
+}
+
+//Move the start of a free block (already out of its bin) up until its
+//payload is aligned. The slack in front becomes a free block of its own.
+static mem_block_t* align_block(mem_heap_t* heap, mem_block_t* block, size_t align_val){
+    uintptr_t payload = reinterpret_cast<uintptr_t>(block_payload(block));
+    size_t lead = ((payload + align_val - 1) & ~(align_val - 1)) - payload;
+    if(lead == 0) return block;
+    if(lead < MIN_BLOCK_SIZE) lead += align_val; //too small to stand alone
+
+    size_t total = block_size(block);
+    mem_block_t* aligned_block = block_at(block, lead);
+    set_block(block, lead, BLOCK_FREE | heap_tag(heap));
+    set_footer(block);
+    bin_insert(heap, block);
+    set_block(aligned_block, total - lead, BLOCK_FREE | BLOCK_PREV_FREE | heap_tag(heap));
+    return aligned_block;
+}
+
+//The caller hands the block out, move the untouched mark past it. The mark
+//only covers the newest segment, an older one may lie above it.
+static void touch_block(mem_heap_t* heap, mem_block_t* block){
+    if(block < heap->segments || block >= heap->top) return;
+    char* end = (char*)next_block(block);
+    if(end > heap->untouched) heap->untouched = end;
+}
+
+//The whole pages of a free block between its trimmed record and its footer.
+//Trimming gives them back, they read zero for as long as the block stays
+//BLOCK_TRIMMED.
+static void free_block_pages(mem_block_t* block, size_t page_size, uintptr_t* start, uintptr_t* end){
+    *start = reinterpret_cast<uintptr_t>(TRIMMED_PAGES(block) + 1);
+    *end = reinterpret_cast<uintptr_t>(next_block(block)) - sizeof(size_t);
+    *start = (*start + page_size - 1) & ~(page_size - 1);
+    *end &= ~(page_size - 1);
+}
+
+//caller holds heap->mutex. zeroed, when given, receives the part of the
+//payload known to read zero: all of it past the trimmed record and before the
+//last word for a block carved from untouched memory, the trimmed pages of a
+//block carved from a trimmed one, nothing otherwise.
+static void* heap_alloc_locked(mem_heap_t* heap, size_t size, size_t align_val = SIZE_CLASS_GRANULE,
+                               mem_zeroed_t* zeroed = nullptr){
+    size = block_size_for(size);
+
+    //an aligned request may have to skip up to align_val + 16 bytes to leave
+    //a valid free block in front of it
+    size_t search_size = size;
+    if(align_val > SIZE_CLASS_GRANULE) search_size += align_val + SIZE_CLASS_GRANULE;
+
+    mem_block_t* block = bin_find(heap, search_size);
+    if(block != nullptr){
+        bin_remove(heap, block);
+    }else{
+        //No suitable block found, request more memory
+        block = heap_grow(heap, search_size);
+        if(block == nullptr) return nullptr;
+    }
+    if(align_val > SIZE_CLASS_GRANULE) block = align_block(heap, block, align_val);
+    if(zeroed != nullptr){
+        uintptr_t start = 0, end = 0;
+        //the mark is in the newest segment, a mapped one may lie below older ones
+        if((char*)block >= heap->untouched && block < heap->top){
+            start = reinterpret_cast<uintptr_t>(TRIMMED_PAGES(block) + 1);
+            end = reinterpret_cast<uintptr_t>(block_at(block, size)) - sizeof(size_t);
+        }else if(block->size_flags & BLOCK_TRIMMED){
+            start = reinterpret_cast<uintptr_t>(TRIMMED_PAGES(block)->start);
+            end = reinterpret_cast<uintptr_t>(TRIMMED_PAGES(block)->end);
+        }
+        zeroed->start = (char*)start;
+        zeroed->end = (char*)end;
+    }
+    use_block(heap, block, size);
+    touch_block(heap, block);
+    return block_payload(block);
+}
+
+//Give the free end of the heap back with a negative sbrk, keeping pad bytes
+//of it. Only possible while the top segment still ends at the break, a huge
+//page region only gives pages back through release_free_pages_locked.
+static size_t trim_top_locked(mem_heap_t* heap, size_t pad){
+    mem_block_t* top = heap->top;
+    if(top == nullptr || heap->top_mapped || !(top->size_flags & BLOCK_PREV_FREE)) return 0;
+
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    mem_block_t* last = prev_block(top);
+    size_t keep = MIN_BLOCK_SIZE + pad;
+    if(block_size(last) <= keep) return 0;
+    size_t release = (block_size(last) - keep) & ~(page_size - 1);
+    if(release == 0) return 0;
+    {
+        //another heap may own the end of the break
+        std::lock_guard<std::mutex> lock(sbrk_mutex);
+        if((char*)sbrk(0) != (char*)(top + 1)) return 0;
+        if(sbrk(-(intptr_t)release) == (void*) -1) return 0;
+    }
+
+    bin_remove(heap, last);
+    set_block(last, block_size(last) - release, BLOCK_FREE | heap_tag(heap));
+    set_footer(last);
+    heap->top = next_block(last);
+    set_block(heap->top, 0, BLOCK_PREV_FREE | heap_tag(heap));
+    bin_insert(heap, last);
+    heap->bytes -= release;
+
+    //pages past the break come back zeroed, the rest of the last one does not
+    char* kept_page = (char*)align_size(reinterpret_cast<uintptr_t>(heap->top + 1), (Alignment)page_size);
+    if(heap->untouched > kept_page) heap->untouched = kept_page;
+    return release;
+}
+
+//madvise away the whole pages inside the free blocks of a size tree. The
+//links at the front and the footer at the back stay mapped.
+static size_t release_free_pages(mem_block_t* node, size_t page_size){
+    if(node == nullptr) return 0;
+    size_t released = release_free_pages(TREE_LINKS(node)->left, page_size)
+                      + release_free_pages(TREE_LINKS(node)->right, page_size);
+    if(node->size_flags & BLOCK_TRIMMED) return released;
+
+    uintptr_t start, end;
+    free_block_pages(node, page_size, &start, &end);
+    if(end <= start) return released;
+
+    if(madvise(reinterpret_cast<void*>(start), end - start, MADV_DONTNEED) == 0){
+        released += end - start;
+        node->size_flags |= BLOCK_TRIMMED;
+        *TRIMMED_PAGES(node) = {(char*)start, (char*)end};
+    }
+    return released;
+}
+
+//with huge pages only whole ones go, a partial one would be split up
+static size_t release_free_pages_locked(mem_heap_t* heap){
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    if(huge_pages.load(std::memory_order_relaxed) != HUGE_PAGES_OFF) page_size = MEM_HUGE_PAGE_SIZE;
+    size_t released = 0;
+    for(size_t index = next_bin(heap, NUM_SMALL_BINS); index < NUM_BINS; index = next_bin(heap, index + 1)){
+        released += release_free_pages(heap->bins[index], page_size);
+    }
+    return released;
+}
+
+//caller holds heap->mutex of the heap owning block
+static void heap_free_locked(mem_heap_t* heap, mem_block_t* block){
+    if(block_is_free(block)) return; //double free
+    //flag it first, if it is merged away the stale header still says free
+    block->size_flags |= BLOCK_FREE;
+    size_t size = block_size(block);
+    size_t freed = size;
+
+    //Coalesce adjacent free blocks, the fence is never free
+    mem_block_t* next = block_at(block, size);
+    if(block_is_free(next)) {
+        bin_remove(heap, next);
+        size += block_size(next);
+    }
+    if(block->size_flags & BLOCK_PREV_FREE) {
+        mem_block_t* prev = prev_block(block);
+        bin_remove(heap, prev);
+        size += block_size(prev);
+        block = prev;
+    }
+
+    set_block(block, size, BLOCK_FREE | heap_tag(heap));
+    set_footer(block);
+    next_block(block)->size_flags |= BLOCK_PREV_FREE;
+    bin_insert(heap, block);
+
+    //A large free end of the heap goes straight back to the OS, keeping
+    //one growth step so the next allocation does not sbrk again. A batch
+    //run freed in one piece is kept whole, it is usually rebuilt right away.
+    size_t threshold = trim_threshold.load(std::memory_order_relaxed);
+    if(threshold != 0 && next_block(block) == heap->top && size >= threshold){
+        size_t pad = heap_growth_min.load(std::memory_order_relaxed);
+        if(pad < freed) pad = freed;
+        size_t released = trim_top_locked(heap, pad);
+        released_bytes.fetch_add(released, std::memory_order_relaxed);
+    }
+}
+
+//caller holds heap->mutex, takes the whole remote list in one exchange
+static void drain_remote_frees(mem_heap_t* heap){
+    if(heap->remote_frees.load(std::memory_order_relaxed) == nullptr) return;
+    mem_block_t* block = heap->remote_frees.exchange(nullptr, std::memory_order_acquire);
+    size_t bytes = 0;
+    while(block != nullptr){
+        mem_block_t* next = FREE_LINKS(block)->next;
+        bytes += block_size(block);
+        heap_free_locked(heap, block);
+        block = next;
+    }
+    heap->remote_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+//Hand a chain of blocks over to their heap. An owner that stopped allocating
+//would sit on them forever, so once REMOTE_DRAIN_BYTES pile up the pusher
+//drains the list itself if the lock happens to be free.
+static void remote_free(mem_heap_t* heap, mem_block_t* first, mem_block_t* last, size_t bytes){
+    //counted before the push, a drain never subtracts bytes not added yet
+    size_t pending = heap->remote_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    remote_push(heap, first, last);
+    if(pending >= REMOTE_DRAIN_BYTES && heap->mutex.try_lock()){
+        std::lock_guard<std::mutex> lock(heap->mutex, std::adopt_lock);
+        drain_remote_frees(heap);
+    }
+}
+
+//lock a heap to allocate from, picking up what other threads freed into it
+static mem_heap_t* lock_heap(){
+    mem_heap_t* heap = try_lock_heaps();
+    drain_remote_frees(heap);
+    return heap;
+}
+
+static mem_mmap_chunk_t* mmap_chunk_of(mem_block_t* block){
+    return (mem_mmap_chunk_t*)((char*)block - offsetof(mem_mmap_chunk_t, block));
+}
+
+static void* mmap_alloc(size_t size, size_t align_val = SIZE_CLASS_GRANULE){
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t slack = align_val > SIZE_CLASS_GRANULE ? align_val : 0;
+    if(size > SIZE_MAX - sizeof(mem_mmap_chunk_t) - slack - page_size) return nullptr;
+    size_t length = (size + sizeof(mem_mmap_chunk_t) + slack + page_size - 1) & ~(page_size - 1);
+    char* mem = (char*)mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED) return nullptr;
+    growth_syscalls.fetch_add(1, std::memory_order_relaxed);
+
+    //place the payload on the first aligned address past the chunk prefix,
+    //whole pages left over on either side go straight back
+    uintptr_t payload = reinterpret_cast<uintptr_t>(mem) + sizeof(mem_mmap_chunk_t);
+    payload = (payload + align_val - 1) & ~(align_val - 1);
+    mem_mmap_chunk_t* chunk = (mem_mmap_chunk_t*)payload - 1;
+    char* base = (char*)(reinterpret_cast<uintptr_t>(chunk) & ~(page_size - 1));
+    char* end = (char*)((payload + size + page_size - 1) & ~(page_size - 1));
+    if(base > mem) munmap(mem, base - mem);
+    if(end < mem + length) munmap(end, mem + length - end);
+
+    chunk->offset = (char*)chunk - base;
+    set_block(&chunk->block, end - base, BLOCK_MMAPPED);
+
+    std::lock_guard<std::mutex> lock(mmap_mutex);
+    chunk->prev = nullptr;
+    chunk->next = mmap_head;
+    if(mmap_head != nullptr) mmap_head->prev = chunk;
+    mmap_head = chunk;
+    return block_payload(&chunk->block);
+}
+
+static void mmap_free(mem_block_t* block){
+    mem_mmap_chunk_t* chunk = mmap_chunk_of(block);
+    {
+        std::lock_guard<std::mutex> lock(mmap_mutex);
+        if(chunk->prev != nullptr) chunk->prev->next = chunk->next;
+        else mmap_head = chunk->next;
+        if(chunk->next != nullptr) chunk->next->prev = chunk->prev;
+    }
+    munmap((char*)chunk - chunk->offset, block_size(block));
+}
+
+//Resize a mapping with mremap, the kernel moves the pages instead of us
+//copying them. The chunk may move, so its neighbours on the list are
+//relinked under the same lock. nullptr when the mapping cannot grow.
+static void* mmap_resize(mem_block_t* block, size_t size){
+    mem_mmap_chunk_t* chunk = mmap_chunk_of(block);
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t offset = chunk->offset;
+    if(size > SIZE_MAX - offset - sizeof(mem_mmap_chunk_t) - page_size) return nullptr;
+    size_t length = (offset + sizeof(mem_mmap_chunk_t) + size + page_size - 1) & ~(page_size - 1);
+    size_t old_length = block_size(block);
+    if(length == old_length) return block_payload(block);
+
+    std::lock_guard<std::mutex> lock(mmap_mutex);
+    char* mem = (char*)mremap((char*)chunk - offset, old_length, length, MREMAP_MAYMOVE);
+    if(mem == MAP_FAILED) return nullptr;
+    if(length > old_length) growth_syscalls.fetch_add(1, std::memory_order_relaxed);
+
+    chunk = (mem_mmap_chunk_t*)(mem + offset);
+    set_block(&chunk->block, length, BLOCK_MMAPPED);
+    if(chunk->prev != nullptr) chunk->prev->next = chunk;
+    else mmap_head = chunk;
+    if(chunk->next != nullptr) chunk->next->prev = chunk;
+    return block_payload(&chunk->block);
+}
+
+//usable bytes behind the payload of a block
+static size_t block_usable_size(mem_block_t* block){
+    if(block->size_flags & BLOCK_MMAPPED){
+        return block_size(block) - mmap_chunk_of(block)->offset - sizeof(mem_mmap_chunk_t);
+    }
+    return block_size(block) - MEM_BLOCK_SIZE;
+}
+
+static mem_heap_t* heap_of(mem_block_t* block){
+    return &heaps[block_heap(block)];
+}
+
+//Resize a heap block where it is, under the lock of the heap owning it.
+//Growing takes in the free block after it, or fresh memory when it ends the
+//newest segment. Whatever is left past the new size is split off and freed.
+//False when the block has to move.
+static bool heap_resize(mem_block_t* block, size_t size){
+    mem_heap_t* heap = heap_of(block);
+    std::lock_guard<std::mutex> lock(heap->mutex);
+    size_t need = block_size_for(size);
+    size_t total = block_size(block);
+
+    if(need > total){
+        mem_block_t* next = next_block(block);
+        size_t free_after = block_is_free(next) ? block_size(next) : 0;
+        if(total + free_after >= need){
+            bin_remove(heap, next);
+        }else{
+            if(block_at(next, free_after) != heap->top) return false;
+            //heap_grow hands back next, merged with the new space, as long
+            //as nobody moved the break, otherwise a new segment
+            mem_block_t* grown = heap_grow(heap, need - total - free_after);
+            if(grown == nullptr) return false;
+            if(grown != next){
+                bin_insert(heap, grown);
+                return false;
+            }
+        }
+        total += block_size(next);
+        next_block(next)->size_flags &= ~BLOCK_PREV_FREE;
+    }
+
+    size_t flags = (block->size_flags & BLOCK_PREV_FREE) | heap_tag(heap);
+    if(total - need < MIN_BLOCK_SIZE){
+        set_block(block, total, flags);
+        touch_block(heap, block);
+        return true;
+    }
+    set_block(block, need, flags);
+    touch_block(heap, block);
+    mem_block_t* tail = block_at(block, need);
+    set_block(tail, total - need, heap_tag(heap));
+    heap_free_locked(heap, tail);
+    return true;
+}
+
+//Carve up to count blocks of size bytes back to back out of one free region
+//large enough for all of them, growing the heap for it when no bin has one.
+//Returns how many it carved, 0 when there is no such region.
+static size_t heap_carve_locked(mem_heap_t* heap, size_t size, size_t count, void** out){
+    size = block_size_for(size);
+    size_t run;
+    if(__builtin_mul_overflow(size, count, &run)) return 0;
+
+    mem_block_t* block = bin_find(heap, run);
+    if(block != nullptr){
+        bin_remove(heap, block);
+    }else{
+        block = heap_grow(heap, run);
+        if(block == nullptr) return 0;
+    }
+
+    size_t total = block_size(block);
+    size_t flags = (block->size_flags & BLOCK_PREV_FREE) | heap_tag(heap);
+    mem_block_t* b = block;
+    for(size_t i = 0; i < count; i++){
+        set_block(b, size, flags);
+        out[i] = block_payload(b);
+        flags = heap_tag(heap);
+        b = block_at(b, size);
+    }
+
+    size_t remaining_size = total - run;
+    if(remaining_size < MIN_BLOCK_SIZE){
+        //too small to stand alone, the last block takes it
+        mem_block_t* last = block_of(out[count - 1]);
+        set_block(last, size + remaining_size, last->size_flags & (BLOCK_PREV_FREE | BLOCK_HEAP_MASK));
+        next_block(last)->size_flags &= ~BLOCK_PREV_FREE;
+    }else{
+        set_block(b, remaining_size, BLOCK_FREE | heap_tag(heap));
+        set_footer(b);
+        bin_insert(heap, b);
+    }
+    touch_block(heap, block_of(out[count - 1]));
+    return count;
+}
+
+size_t heap_alloc_batch(size_t size, size_t count, void** out){
+    mem_heap_t* heap = lock_heap();
+    std::lock_guard<std::mutex> lock(heap->mutex, std::adopt_lock);
+    size_t n = 0;
+    while(n < count){
+        void* ptr = heap_alloc_locked(heap, size);
+        if(ptr == nullptr) break;
+        out[n++] = ptr;
+    }
+    return n;
+}
+
+//caller holds heap->mutex of the heap owning every block. Blocks next to
+//each other both in ptrs and in memory, in either order, are joined first
+//and go through the bins once.
+static void heap_free_run_locked(mem_heap_t* heap, void** ptrs, size_t count){
+    size_t i = 0;
+    while(i < count){
+        mem_block_t* first = block_of(ptrs[i++]);
+        mem_block_t* last = first;
+        while(i < count && !block_is_free(first)){
+            mem_block_t* block = block_of(ptrs[i]);
+            if(block_is_free(block)) break;
+            if(block == next_block(last)) last = block;
+            else if(next_block(block) == first) first = block;
+            else break;
+            i++;
+        }
+        if(first != last){
+            size_t size = (char*)next_block(last) - (char*)first;
+            set_block(first, size, (first->size_flags & BLOCK_PREV_FREE) | heap_tag(heap));
+        }
+        heap_free_locked(heap, first);
+    }
+}
+
+//runs of blocks from the same heap are freed under one lock acquisition, or
+//handed over to it with a single push
+void heap_free_batch(void** ptrs, size_t count){
+    size_t i = 0;
+    while(i < count){
+        mem_heap_t* heap = heap_of(block_of(ptrs[i]));
+        size_t end = i + 1;
+        while(end < count && heap_of(block_of(ptrs[end])) == heap) end++;
+
+        if(lock_owner(heap)){
+            std::lock_guard<std::mutex> lock(heap->mutex, std::adopt_lock);
+            drain_remote_frees(heap);
+            heap_free_run_locked(heap, ptrs + i, end - i);
+            i = end;
+            continue;
+        }
+        size_t bytes = block_size(block_of(ptrs[end - 1]));
+        for(size_t j = i; j + 1 < end; j++){
+            FREE_LINKS(block_of(ptrs[j]))->next = block_of(ptrs[j + 1]);
+            bytes += block_size(block_of(ptrs[j]));
+        }
+        remote_free(heap, block_of(ptrs[i]), block_of(ptrs[end - 1]), bytes);
+        i = end;
+    }
+}
+
+void heap_walk(heap_visitor& visitor){
+    for(size_t i = 0; i < MEM_MAX_HEAPS; i++){
+        mem_heap_t* heap = &heaps[i];
+        std::lock_guard<std::mutex> lock(heap->mutex);
+        if(heap->segments == nullptr) continue;
+
+        visitor.begin_heap(i, heap->bytes);
+        for(mem_block_t* first = heap->segments; first != nullptr; first = ((mem_block_t**)first)[-1]){
+            visitor.begin_segment(first);
+            for(mem_block_t* b = first; block_size(b) != 0; b = next_block(b)){
+                visitor.block(b);
+            }
+            visitor.end_segment();
+        }
+        visitor.end_heap();
+    }
+}
+
+void mmap_walk(heap_visitor& visitor){
+    std::lock_guard<std::mutex> lock(mmap_mutex);
+    for(mem_mmap_chunk_t* chunk = mmap_head; chunk != nullptr; chunk = chunk->next){
+        visitor.mmapped(&chunk->block);
+    }
+}
+
+//usable bytes behind ptr, slab objects have no header to read it from
+static size_t usable_size(void* ptr){
+    if(slab_contains(ptr)) return slab_class_size(slab_class_of(ptr));
+    return block_usable_size(block_of(ptr));
+}
+
+static inline void record_alloc(size_t size, void* ptr){
+    profile_alloc(ptr, size);
+    size_t usable = usable_size(ptr);
+    if(!mem_thread_stats.active && !stats_attach(&mem_thread_stats)){
+        stats_record_retired_alloc(size, usable);
         return;
     }
-    head->size = INITIAL_BLOCK_SIZE;
-    head->free = true;
-    head->is_aligned = false;
-    head->next = nullptr;
+    stats_add(mem_thread_stats.allocated_bytes, usable);
+    stats_add(mem_thread_stats.histogram[mem_stats_bucket(size)], 1);
+}
+
+//called before the memory goes back, its sample must be gone before it can
+//be handed out again
+static inline void record_free(void* ptr, size_t usable){
+    profile_free(ptr);
+    if(!mem_thread_stats.active && !stats_attach(&mem_thread_stats)){
+        stats_record_retired_free(usable);
+        return;
+    }
+    stats_add(mem_thread_stats.frees, 1);
+    stats_add(mem_thread_stats.freed_bytes, usable);
+}
+
+static inline void* alloc_block(size_t size){
+    if(size <= SLAB_MAX_SIZE){
+        void* ptr = tcache_slab_alloc(slab_class_index(size));
+        //without slabs the heap takes it, header and all
+        if(ptr != nullptr) return ptr;
+    }
+    if(size <= SIZE_CLASS_MAX){
+        return tcache_alloc(size_class_index(size));
+    }
+    if(size >= mmap_threshold.load(std::memory_order_relaxed)){
+        return mmap_alloc(size);
+    }
+
+    mem_heap_t* heap = lock_heap();
+    std::lock_guard<std::mutex> lock(heap->mutex, std::adopt_lock);
+    return heap_alloc_locked(heap, size);
+}
+
+void* mem_alloc(size_t size){
+    void* ptr = alloc_block(size);
+    if(ptr != nullptr) record_alloc(size, ptr);
+    return ptr;
+}
+
+//Allocate bytes of zeroed memory. Heap memory past the untouched mark, the
+//pages trimming gave back and fresh mappings are zero already, they skip
+//the memset.
+static void* alloc_block_zeroed(size_t bytes){
+    if(bytes <= SLAB_MAX_SIZE){
+        void* ptr = tcache_slab_alloc(slab_class_index(bytes));
+        if(ptr != nullptr){
+            memset(ptr, 0, bytes);
+            return ptr;
+        }
+    }
+    if(bytes >= mmap_threshold.load(std::memory_order_relaxed)){
+        return mmap_alloc(bytes);
+    }
+
+    void* ptr;
+    mem_zeroed_t zeroed = {nullptr, nullptr};
+    if(bytes <= SIZE_CLASS_MAX){
+        ptr = tcache_alloc(size_class_index(bytes));
+    }else{
+        mem_heap_t* heap = lock_heap();
+        std::lock_guard<std::mutex> lock(heap->mutex, std::adopt_lock);
+        ptr = heap_alloc_locked(heap, bytes, SIZE_CLASS_GRANULE, &zeroed);
+    }
+    if(ptr == nullptr) return nullptr;
+
+    //clear around the part known to be zero, or all of it
+    char* start = (char*)ptr;
+    char* end = start + bytes;
+    if(zeroed.start < zeroed.end && zeroed.start < end){
+        memset(start, 0, zeroed.start - start);
+        if(zeroed.end < end) memset(zeroed.end, 0, end - zeroed.end);
+    }else{
+        memset(start, 0, bytes);
+    }
+    return ptr;
+}
+
+static void* alloc_block_align(size_t size, size_t align_val){
+    size_t class_index = slab_class_align(size, align_val);
+    if(class_index < NUM_SLAB_CLASSES){
+        void* ptr = tcache_slab_alloc(class_index);
+        if(ptr != nullptr) return ptr;
+    }
+
+    //every payload is already 16 byte aligned
+    if(align_val <= SIZE_CLASS_GRANULE) return alloc_block(size);
+
+    //the block is carved at an aligned address straight out of the heap,
+    //only the most recently cached block is worth a look
+    if(size <= SIZE_CLASS_MAX){
+        void* ptr = tcache_alloc_aligned(size_class_index(size), align_val);
+        if(ptr != nullptr) return ptr;
+    }
+    if(size >= mmap_threshold.load(std::memory_order_relaxed)){
+        return mmap_alloc(size, align_val);
+    }
+
+    mem_heap_t* heap = lock_heap();
+    std::lock_guard<std::mutex> lock(heap->mutex, std::adopt_lock);
+    return heap_alloc_locked(heap, size, align_val);
 }
 
 void* mem_alloc_align(size_t size, Alignment alignment = Alignment::ALIGN_NATURAL){
@@ -30,116 +954,271 @@ void* mem_alloc_align(size_t size, Alignment alignment = Alignment::ALIGN_NATURA
     //Ensure alignment is a power of 2
     assert((align_val & (align_val-1)) == 0 && "alignment must be a power of 2");
 
-    //we need space for:
-    //1) the aligned block
-    //2) space to store the original unaligned pointer(we need it for free)
-    //3) Padding for alignment
-    size_t total_size = size + sizeof(void*) + align_val;
-
-    void* unaligned = mem_alloc(total_size);
-    if(!unaligned) return nullptr;
-
-    //compute alignment
-    uintptr_t raw_addr = reinterpret_cast<uintptr_t>(unaligned);
-    uintptr_t aligned_addr = (raw_addr + sizeof(void*) + align_val-1) & ~(align_val - 1);
+    void* ptr = alloc_block_align(size, align_val);
+    if(ptr != nullptr) record_alloc(size, ptr);
+    return ptr;
+}
 
-    //store original ptr just before aligned block
-    void** block_ptr_location = reinterpret_cast<void**>(aligned_addr-sizeof(void*));
-    *block_ptr_location = unaligned;
+void* mem_calloc(size_t count, size_t size){
+    size_t bytes;
+    if(__builtin_mul_overflow(count, size, &bytes)) return nullptr;
 
-    return reinterpret_cast<void*>(aligned_addr);
+    void* ptr = alloc_block_zeroed(bytes);
+    if(ptr != nullptr) record_alloc(bytes, ptr);
+    return ptr;
 }
 
 void* mem_alloc_align_type(size_t size, AlignmentForType type_alignment){
     return mem_alloc_align(size, static_cast<Alignment>(type_alignment));
 }
 
-void* mem_alloc(size_t size){
-    std::lock_guard<std::mutex> lock(alloc_mutex);
-    
-    if(head == nullptr) {
-        init_mem_pool();
-    }
-    mem_block_t* current = head;
-    mem_block_t* prev = nullptr;
-    while(current != nullptr){
-       if(current->free && current->size == size){
-            //Found a suitable block
-            current->free = false;
-            return (void*)(current + 1);
-       }else if(current->free && current->size > size){
-            size_t remaining_size = current->size - size;
-            if(remaining_size <= MEM_BLOCK_SIZE){
-                //Not enough space to split, allocate entire block
-                current->free = false;
-                return (void*)(current + 1);
-            }
+void mem_free(void* ptr) {
+    if(ptr == nullptr) return;
 
-            //Large enough to split, split it
-            mem_block_t* new_block = (mem_block_t*)((char*)(current + 1) + size);
-            new_block->free = true;
-            new_block->size = current->size - size - MEM_BLOCK_SIZE;
-            new_block->is_aligned = false;
-            new_block->next = current->next;
-
-            //update current block
-            current->free = false;
-            current->size = size;
-            current->is_aligned = false;
-            current->next = new_block;
-            return (void*)(current + 1); 
-       }
-       prev = current; 
-       current = current->next;
-    };
-
-    //No suitable block found, request more memory
-    mem_block_t* new_block = (mem_block_t*) sbrk(size + MEM_BLOCK_SIZE);
-    if(new_block == (void*) -1) {
-        return nullptr; //sbrk failed
+    if(slab_contains(ptr)){
+        size_t class_index = slab_class_of(ptr);
+        record_free(ptr, slab_class_size(class_index));
+        tcache_slab_free(ptr, class_index);
+        return;
     }
-    new_block->size = size;
-    new_block->free = false;
-    new_block->is_aligned = false;
-    new_block->next = nullptr;
-    
-    //Link the new block
-    if (prev != nullptr) {
-        prev->next = new_block;
-    } else {
-        head = new_block;  // This would be the first block
+
+    mem_block_t* block = block_of(ptr);
+    if(block_is_free(block)) return; //double free
+
+    size_t usable = block_usable_size(block);
+    record_free(ptr, usable);
+    if(block->size_flags & BLOCK_MMAPPED){
+        mmap_free(block);
+        return;
+    }
+
+    //small blocks go back to this thread's cache
+    if(usable <= SIZE_CLASS_MAX){
+        tcache_free(ptr, size_class_index_floor(usable));
+        return;
     }
-    return (void*)(new_block + 1);
+
+    mem_heap_t* heap = heap_of(block);
+    if(!lock_owner(heap)){
+        remote_free(heap, block, block, block_size(block));
+        return;
+    }
+    std::lock_guard<std::mutex> lock(heap->mutex, std::adopt_lock);
+    drain_remote_frees(heap);
+    heap_free_locked(heap, block);
 }
 
-void mem_free(void* ptr) {
-    std::lock_guard<std::mutex> lock(alloc_mutex);
+//Slab objects go straight to the bin of the class the size names, without
+//working it out from the address. Heap blocks still read their header, a
+//block can be larger than what was asked for and its own size is what the
+//bins and the counters need. Debug builds check the size against the block.
+static void free_sized(void* ptr, size_t size, size_t align_val){
     if(ptr == nullptr) return;
-    
-    mem_block_t* block = (mem_block_t*)ptr - 1;
-    void* actual_ptr = ptr;
-    
-    if(block->is_aligned) {
-        void** back_ptr = reinterpret_cast<void**>(ptr) - 1;
-        actual_ptr = *back_ptr;
-        block = (mem_block_t*)actual_ptr - 1;
-    }
-    block->free = true;
-
-    //Coalesce adjacent free blocks
-    if(block->next != nullptr && block->next->free) {
-        block->size += MEM_BLOCK_SIZE + block->next->size;
-        block->next = block->next->next;
-    }
-    mem_block_t* current = head;
-    while(current->next != nullptr) {
-        if(current->next == block){
-            if(current->free) {
-                current->size += MEM_BLOCK_SIZE + block->size;
-                current->next = block->next;
+
+    size_t class_index = slab_class_align(size, align_val);
+    if(class_index < NUM_SLAB_CLASSES && slab_contains(ptr)){
+        assert(class_index == slab_class_of(ptr) && "size does not match the allocation");
+        record_free(ptr, slab_class_size(class_index));
+        tcache_slab_free(ptr, class_index);
+        return;
+    }
+    assert(size <= mem_usable_size(ptr) && "size does not match the allocation");
+    mem_free(ptr);
+}
+
+void mem_free_sized(void* ptr, size_t size){
+    free_sized(ptr, size, SLAB_GRANULE);
+}
+
+void mem_free_aligned_sized(void* ptr, size_t size, Alignment alignment){
+    free_sized(ptr, size, static_cast<size_t>(alignment));
+}
+
+//Every allocator lock is held across fork, so the child never inherits one
+//taken by a thread that does not exist there.
+static void fork_prepare(){
+    for(mem_heap_t& heap : heaps) heap.mutex.lock();
+    sbrk_mutex.lock();
+    mmap_mutex.lock();
+}
+
+static void fork_release(){
+    mmap_mutex.unlock();
+    sbrk_mutex.unlock();
+    for(mem_heap_t& heap : heaps) heap.mutex.unlock();
+}
+
+static const int fork_handlers = pthread_atfork(fork_prepare, fork_release, fork_release);
+
+size_t mem_alloc_batch(size_t size, size_t count, void** out){
+    size_t n = 0;
+    if(size <= SLAB_MAX_SIZE){
+        n = slab_alloc_batch(slab_class_index(size), count, out);
+    }
+    if(n < count && size >= mmap_threshold.load(std::memory_order_relaxed)){
+        for(; n < count; n++){
+            out[n] = mmap_alloc(size);
+            if(out[n] == nullptr) break;
+        }
+    }else if(n < count){
+        mem_heap_t* heap = lock_heap();
+        std::lock_guard<std::mutex> lock(heap->mutex, std::adopt_lock);
+        n += heap_carve_locked(heap, size, count - n, out + n);
+        //no region for the whole run, take the blocks one at a time
+        for(; n < count; n++){
+            out[n] = heap_alloc_locked(heap, size);
+            if(out[n] == nullptr) break;
+        }
+    }
+
+    for(size_t i = 0; i < n; i++){
+        record_alloc(size, out[i]);
+    }
+    return n;
+}
+
+static void free_run(void** ptrs, size_t count, bool slab){
+    if(slab) slab_free_batch(ptrs, count);
+    else heap_free_batch(ptrs, count);
+}
+
+void mem_free_batch(void** ptrs, size_t count){
+    //stretches of slab objects and of heap blocks go to slab_free_batch and
+    //heap_free_batch straight from ptrs, skipping the thread cache, mapped
+    //blocks are unmapped on the way
+    size_t run = 0;
+    bool slab_run = false;
+    for(size_t i = 0; i < count; i++){
+        if(ptrs[i] != nullptr && slab_contains(ptrs[i])){
+            if(!slab_run){
+                free_run(ptrs + run, i - run, false);
+                run = i;
+                slab_run = true;
+            }
+            record_free(ptrs[i], slab_class_size(slab_class_of(ptrs[i])));
+            continue;
+        }
+
+        mem_block_t* block = ptrs[i] == nullptr ? nullptr : block_of(ptrs[i]);
+        bool heap_block = block != nullptr && !block_is_free(block) && !(block->size_flags & BLOCK_MMAPPED);
+        if(heap_block){
+            if(slab_run){
+                free_run(ptrs + run, i - run, true);
+                run = i;
+                slab_run = false;
             }
-            break;
+            record_free(ptrs[i], block_usable_size(block));
+            continue;
         }
-        current = current->next;
+        free_run(ptrs + run, i - run, slab_run);
+        run = i + 1;
+        slab_run = false;
+        if(block == nullptr || block_is_free(block)) continue; //double free
+
+        record_free(ptrs[i], block_usable_size(block));
+        mmap_free(block);
+    }
+    free_run(ptrs + run, count - run, slab_run);
+}
+
+//move a block that cannot be resized where it is
+static void* move_block(void* ptr, size_t usable, size_t size){
+    void* moved = mem_alloc(size);
+    if(moved == nullptr) return nullptr;
+    memcpy(moved, ptr, usable < size ? usable : size);
+    mem_free(ptr);
+    return moved;
+}
+
+void* mem_realloc(void* ptr, size_t size){
+    if(ptr == nullptr) return mem_alloc(size);
+    if(size == 0){
+        mem_free(ptr);
+        return nullptr;
+    }
+
+    if(slab_contains(ptr)){
+        //a slab object keeps its size, it stays only while the class fits
+        size_t class_index = slab_class_of(ptr);
+        if(slab_class_index(size) == class_index) return ptr;
+        return move_block(ptr, slab_class_size(class_index), size);
+    }
+
+    mem_block_t* block = block_of(ptr);
+    if(block_is_free(block)) return nullptr; //freed already
+    size_t usable = block_usable_size(block);
+
+    void* resized = nullptr;
+    if(block->size_flags & BLOCK_MMAPPED){
+        resized = mmap_resize(block, size);
+    }else if(size <= usable && block_size(block) - block_size_for(size) < MIN_BLOCK_SIZE){
+        return ptr; //nothing worth splitting off
+    }else if(size <= SIZE_CLASS_MAX && usable <= SIZE_CLASS_MAX){
+        //small blocks move through the thread cache, that beats the lock
+    }else if(size < mmap_threshold.load(std::memory_order_relaxed) && heap_resize(block, size)){
+        resized = ptr;
+    }
+
+    if(resized != nullptr){
+        record_free(ptr, usable);
+        record_alloc(size, resized);
+        return resized;
     }
+
+    //last resort, move it
+    return move_block(ptr, usable, size);
+}
+
+size_t mem_usable_size(void* ptr){
+    if(ptr == nullptr) return 0;
+
+    return usable_size(ptr);
+}
+
+void mem_configure(const mem_config_t& config){
+    mmap_threshold.store(config.mmap_threshold, std::memory_order_relaxed);
+    heap_growth_min.store(config.heap_growth_min, std::memory_order_relaxed);
+    trim_threshold.store(config.trim_threshold, std::memory_order_relaxed);
+    size_t count = config.heap_count < MEM_MAX_HEAPS ? config.heap_count : MEM_MAX_HEAPS;
+    heap_count.store(count, std::memory_order_relaxed);
+    heap_select.store(config.heap_select, std::memory_order_relaxed);
+    huge_pages.store(config.huge_pages, std::memory_order_relaxed);
+    heap_profile_configure(config.profile_sample_rate);
+}
+
+mem_config_t mem_get_config(){
+    mem_config_t config;
+    config.mmap_threshold = mmap_threshold.load(std::memory_order_relaxed);
+    config.heap_growth_min = heap_growth_min.load(std::memory_order_relaxed);
+    config.trim_threshold = trim_threshold.load(std::memory_order_relaxed);
+    config.heap_count = active_heaps();
+    config.heap_select = heap_select.load(std::memory_order_relaxed);
+    config.huge_pages = huge_pages.load(std::memory_order_relaxed);
+    config.profile_sample_rate = heap_profile_rate.load(std::memory_order_relaxed);
+    return config;
+}
+
+size_t mem_growth_syscalls(){
+    return growth_syscalls.load(std::memory_order_relaxed);
+}
+
+size_t mem_trim(size_t pad){
+    //blocks parked in this thread's cache count as used by the heap, freeing
+    //them may already trim the top, so count from here
+    size_t released_before = released_bytes.load(std::memory_order_relaxed);
+    tcache_flush_all();
+
+    //heaps past the current count may still hold memory
+    size_t released = slab_trim();
+    for(mem_heap_t& heap : heaps){
+        std::lock_guard<std::mutex> lock(heap.mutex);
+        drain_remote_frees(&heap);
+        released += trim_top_locked(&heap, pad) + release_free_pages_locked(&heap);
+    }
+    released_bytes.fetch_add(released, std::memory_order_relaxed);
+    return released_bytes.load(std::memory_order_relaxed) - released_before;
+}
+
+size_t mem_released_bytes(){
+    return released_bytes.load(std::memory_order_relaxed);
 }
@@ -0,0 +1,110 @@
+#include "../include/arena.hpp"
+#include "../include/alloc.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+
+//chunks form a singly linked list, data follows the header
+typedef struct mem_arena_chunk{
+    struct mem_arena_chunk* next;
+    size_t capacity;
+}mem_arena_chunk_t;
+
+#define ARENA_CHUNK_HEADER align_size(sizeof(mem_arena_chunk_t), ALIGN_NATURAL)
+
+struct mem_arena{
+    size_t chunk_size;
+    mem_arena_chunk_t* first;
+    mem_arena_chunk_t* current;
+    uintptr_t cursor;
+    uintptr_t end;
+};
+
+static uintptr_t chunk_data(mem_arena_chunk_t* chunk){
+    return reinterpret_cast<uintptr_t>(chunk) + ARENA_CHUNK_HEADER;
+}
+
+static void use_chunk(mem_arena_t* arena, mem_arena_chunk_t* chunk){
+    arena->current = chunk;
+    arena->cursor = chunk_data(chunk);
+    arena->end = arena->cursor + chunk->capacity;
+}
+
+static mem_arena_chunk_t* new_chunk(size_t capacity){
+    size_t bytes;
+    if(__builtin_add_overflow(ARENA_CHUNK_HEADER, capacity, &bytes)) return nullptr;
+    mem_arena_chunk_t* chunk = (mem_arena_chunk_t*) mem_alloc(bytes);
+    if(chunk == nullptr) return nullptr;
+    chunk->next = nullptr;
+    chunk->capacity = capacity;
+    return chunk;
+}
+
+mem_arena_t* mem_arena_create(size_t chunk_size){
+    mem_arena_t* arena = (mem_arena_t*) mem_alloc(sizeof(mem_arena_t));
+    if(arena == nullptr) return nullptr;
+
+    arena->chunk_size = chunk_size;
+    arena->first = new_chunk(chunk_size);
+    if(arena->first == nullptr){
+        mem_free(arena);
+        return nullptr;
+    }
+    use_chunk(arena, arena->first);
+    return arena;
+}
+
+//Move on to a chunk with room for size + align_val bytes. Chunks kept from
+//before a reset are reused in order, a new chunk is linked in right after
+//the current one when the next one is too small. False when no chunk can
+//hold that many bytes.
+static bool next_chunk(mem_arena_t* arena, size_t size, size_t align_val){
+    size_t needed;
+    if(__builtin_add_overflow(size, align_val, &needed)) return false;
+    mem_arena_chunk_t* next = arena->current->next;
+    if(next == nullptr || next->capacity < needed){
+        size_t capacity = needed > arena->chunk_size ? needed : arena->chunk_size;
+        mem_arena_chunk_t* chunk = new_chunk(capacity);
+        if(chunk == nullptr) return false;
+        chunk->next = next;
+        arena->current->next = chunk;
+        next = chunk;
+    }
+    use_chunk(arena, next);
+    return true;
+}
+
+void* mem_arena_alloc_align(mem_arena_t* arena, size_t size, Alignment alignment){
+    size_t align_val = static_cast<size_t>(alignment);
+
+    //Ensure alignment is a power of 2
+    assert((align_val & (align_val-1)) == 0 && "alignment must be a power of 2");
+
+    uintptr_t addr = (arena->cursor + align_val - 1) & ~(align_val - 1);
+    if(addr > arena->end || arena->end - addr < size){
+        if(!next_chunk(arena, size, align_val)) return nullptr;
+        addr = (arena->cursor + align_val - 1) & ~(align_val - 1);
+    }
+    arena->cursor = addr + size;
+    return reinterpret_cast<void*>(addr);
+}
+
+void* mem_arena_alloc(mem_arena_t* arena, size_t size){
+    return mem_arena_alloc_align(arena, size, ALIGN_NATURAL);
+}
+
+void mem_arena_reset(mem_arena_t* arena){
+    use_chunk(arena, arena->first);
+}
+
+void mem_arena_destroy(mem_arena_t* arena){
+    if(arena == nullptr) return;
+
+    mem_arena_chunk_t* chunk = arena->first;
+    while(chunk != nullptr){
+        mem_arena_chunk_t* next = chunk->next;
+        mem_free(chunk);
+        chunk = next;
+    }
+    mem_free(arena);
+}
@@ -0,0 +1,332 @@
+#include "../include/heap_profile.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <mutex>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define PROFILE_FILTER_BITS 14
+#define PROFILE_FILTER_SIZE ((size_t)1 << PROFILE_FILTER_BITS)
+#define PROFILE_MIN_SLOTS 256
+
+typedef struct heap_sample{
+    void* ptr;   //nullptr in an empty slot
+    size_t size; //bytes asked for
+    size_t rate; //mean distance between samples when it was taken
+    size_t depth;
+    void* frames[MEM_HEAP_PROFILE_DEPTH]; //innermost first
+}heap_sample_t;
+
+std::atomic<size_t> heap_profile_rate{0};
+std::atomic<size_t> heap_profile_samples{0};
+
+//Live samples by address, open addressing with linear probing, under
+//profile_mutex. The table is a mapping of its own, heap memory would be
+//sampled itself.
+static std::mutex profile_mutex;
+static heap_sample_t* sample_table = nullptr;
+static size_t table_slots = 0;
+//Live samples by address hash, read without the lock. A free whose count is
+//0 is not sampled and never takes profile_mutex.
+static std::atomic<uint32_t> sample_filter[PROFILE_FILTER_SIZE];
+
+//bumped when the rate changes, each thread then draws a new distance
+static std::atomic<size_t> rate_generation{0};
+
+static thread_local int64_t bytes_until_sample = 0;
+static thread_local size_t thread_generation = 0;
+static thread_local uint64_t rng_state = 0;
+//set while the thread runs the profiler, whatever backtrace allocates is
+//not sampled
+static thread_local bool in_profiler = false;
+
+static uint64_t ptr_hash(const void* ptr){
+    return (reinterpret_cast<uintptr_t>(ptr) >> 3) * 0x9E3779B97F4A7C15ull;
+}
+
+static std::atomic<uint32_t>& filter_of(const void* ptr){
+    return sample_filter[ptr_hash(ptr) >> (64 - PROFILE_FILTER_BITS)];
+}
+
+static size_t home_slot(const void* ptr, size_t slots){
+    return ptr_hash(ptr) >> (64 - __builtin_ctzll(slots));
+}
+
+//slot holding ptr, or the empty slot it would go in
+static size_t find_slot(const heap_sample_t* table, size_t slots, const void* ptr){
+    size_t i = home_slot(ptr, slots);
+    while(table[i].ptr != nullptr && table[i].ptr != ptr) i = (i + 1) & (slots - 1);
+    return i;
+}
+
+static bool grow_table_locked(){
+    size_t slots = table_slots == 0 ? PROFILE_MIN_SLOTS : 2 * table_slots;
+    heap_sample_t* table = (heap_sample_t*)mmap(nullptr, slots * sizeof(heap_sample_t), PROT_READ | PROT_WRITE,
+                                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(table == MAP_FAILED) return false;
+    for(size_t i = 0; i < table_slots; i++){
+        const heap_sample_t& sample = sample_table[i];
+        if(sample.ptr != nullptr) table[find_slot(table, slots, sample.ptr)] = sample;
+    }
+    if(sample_table != nullptr) munmap(sample_table, table_slots * sizeof(heap_sample_t));
+    sample_table = table;
+    table_slots = slots;
+    return true;
+}
+
+//a sample the table has no room for is dropped
+static void insert_locked(const heap_sample_t& sample){
+    size_t live = heap_profile_samples.load(std::memory_order_relaxed);
+    if(2 * (live + 1) > table_slots && !grow_table_locked()) return;
+    size_t i = find_slot(sample_table, table_slots, sample.ptr);
+    if(sample_table[i].ptr == nullptr){
+        filter_of(sample.ptr).fetch_add(1, std::memory_order_relaxed);
+        heap_profile_samples.store(live + 1, std::memory_order_relaxed);
+    }
+    sample_table[i] = sample;
+}
+
+//xorshift64*, seeded from where the thread's state lives
+static uint64_t next_random(){
+    if(rng_state == 0) rng_state = (reinterpret_cast<uintptr_t>(&rng_state) * 0x9E3779B97F4A7C15ull) | 1;
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+//bytes to the next sample, exponential with the rate as its mean
+static int64_t sample_distance(size_t rate){
+    double u = (double)((next_random() >> 11) + 1) * 0x1.0p-53; //(0, 1]
+    return (int64_t)(-std::log(u) * (double)rate) + 1;
+}
+
+void heap_profile_configure(size_t rate){
+    size_t old = heap_profile_rate.load(std::memory_order_relaxed);
+    if(rate == old) return;
+    if(old == 0){
+        //the first backtrace loads the unwinder, which allocates
+        in_profiler = true;
+        void* frame;
+        backtrace(&frame, 1);
+        in_profiler = false;
+    }
+    rate_generation.fetch_add(1, std::memory_order_relaxed);
+    heap_profile_rate.store(rate, std::memory_order_relaxed);
+}
+
+void heap_profile_alloc(void* ptr, size_t size){
+    size_t rate = heap_profile_rate.load(std::memory_order_relaxed);
+    if(rate == 0 || in_profiler) return;
+    size_t generation = rate_generation.load(std::memory_order_relaxed);
+    if(thread_generation != generation){
+        thread_generation = generation;
+        bytes_until_sample = sample_distance(rate);
+    }
+    bytes_until_sample -= (int64_t)size;
+    if(bytes_until_sample > 0) return;
+    bytes_until_sample = sample_distance(rate);
+
+    in_profiler = true;
+    heap_sample_t sample;
+    sample.ptr = ptr;
+    sample.size = size;
+    sample.rate = rate;
+    //this frame is left out, the stack starts at the mem_ call
+    void* frames[MEM_HEAP_PROFILE_DEPTH + 1];
+    int depth = backtrace(frames, MEM_HEAP_PROFILE_DEPTH + 1);
+    sample.depth = depth > 1 ? depth - 1 : 0;
+    memcpy(sample.frames, frames + 1, sample.depth * sizeof(void*));
+    {
+        std::lock_guard<std::mutex> lock(profile_mutex);
+        insert_locked(sample);
+    }
+    in_profiler = false;
+}
+
+void heap_profile_free(void* ptr){
+    std::atomic<uint32_t>& filter = filter_of(ptr);
+    if(in_profiler || filter.load(std::memory_order_relaxed) == 0) return;
+
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    size_t mask = table_slots - 1;
+    size_t i = find_slot(sample_table, table_slots, ptr);
+    if(sample_table[i].ptr == nullptr) return;
+    filter.fetch_sub(1, std::memory_order_relaxed);
+    heap_profile_samples.fetch_sub(1, std::memory_order_relaxed);
+
+    //no tombstones, later entries of the run move back into the hole
+    //unless that would put them before their home slot
+    for(size_t j = (i + 1) & mask; sample_table[j].ptr != nullptr; j = (j + 1) & mask){
+        size_t home = home_slot(sample_table[j].ptr, table_slots);
+        if(((j - home) & mask) >= ((j - i) & mask)){
+            sample_table[i] = sample_table[j];
+            i = j;
+        }
+    }
+    sample_table[i].ptr = nullptr;
+}
+
+//A sample can be taken while another thread forks, the child must not
+//inherit the lock held.
+static void fork_prepare(){
+    profile_mutex.lock();
+}
+
+static void fork_release(){
+    profile_mutex.unlock();
+}
+
+static const int fork_handlers = pthread_atfork(fork_prepare, fork_release, fork_release);
+
+//Formats into a fixed buffer and writes it out with write(2), like
+//mem_dump_heap, so the dump itself does not allocate.
+struct profile_writer{
+    int fd;
+    char buffer[4096];
+    size_t length = 0;
+    bool failed = false;
+
+    void flush(){
+        size_t done = 0;
+        while(done < length){
+            ssize_t n = write(fd, buffer + done, length - done);
+            if(n <= 0){
+                failed = true;
+                break;
+            }
+            done += n;
+        }
+        length = 0;
+    }
+
+    void print(const char* fmt, ...){
+        if(sizeof(buffer) - length < 256) flush();
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(buffer + length, sizeof(buffer) - length, fmt, args);
+        va_end(args);
+        if(n > 0) length += (size_t)n < sizeof(buffer) - length ? n : sizeof(buffer) - length - 1;
+    }
+
+    void copy_file(const char* path){
+        int in = open(path, O_RDONLY | O_CLOEXEC);
+        if(in < 0) return;
+        flush();
+        ssize_t n;
+        while((n = read(in, buffer, sizeof(buffer))) > 0){
+            length = n;
+            flush();
+        }
+        close(in);
+    }
+};
+
+static bool same_stack(const heap_sample_t* a, const heap_sample_t* b){
+    return a->depth == b->depth && memcmp(a->frames, b->frames, a->depth * sizeof(void*)) == 0;
+}
+
+static bool stack_less(const heap_sample_t* a, const heap_sample_t* b){
+    if(a->depth != b->depth) return a->depth < b->depth;
+    return memcmp(a->frames, b->frames, a->depth * sizeof(void*)) < 0;
+}
+
+//bytes a sample stands for, the inverse of its chance of being taken
+static double estimated_bytes(const heap_sample_t* sample){
+    if(sample->size == 0) return 0;
+    return sample->size / -std::expm1(-(double)sample->size / (double)sample->rate);
+}
+
+//frames are return addresses, one byte back names the function of the call
+static void print_frame(profile_writer& out, void* frame){
+    Dl_info info;
+    if(dladdr((char*)frame - 1, &info) != 0 && info.dli_sname != nullptr){
+        out.print("%s", info.dli_sname);
+    }else{
+        out.print("%p", frame);
+    }
+}
+
+//samples of equal stacks are next to each other in order
+static void write_samples(profile_writer& out, heap_sample_t** order, size_t count, ProfileFormat format){
+    size_t objects = 0, bytes = 0;
+    for(size_t i = 0; i < count; i++){
+        objects++;
+        bytes += order[i]->size;
+    }
+    if(format == PROFILE_PPROF){
+        size_t rate = heap_profile_rate.load(std::memory_order_relaxed);
+        if(rate == 0) rate = count > 0 ? order[0]->rate : 1;
+        out.print("heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", objects, bytes, objects, bytes, rate);
+    }
+
+    for(size_t start = 0, end; start < count; start = end){
+        size_t group_objects = 0, group_bytes = 0;
+        double group_estimate = 0;
+        for(end = start; end < count && same_stack(order[start], order[end]); end++){
+            group_objects++;
+            group_bytes += order[end]->size;
+            group_estimate += estimated_bytes(order[end]);
+        }
+
+        const heap_sample_t* sample = order[start];
+        if(format == PROFILE_PPROF){
+            out.print("%zu: %zu [%zu: %zu] @", group_objects, group_bytes, group_objects, group_bytes);
+            for(size_t f = 0; f < sample->depth; f++) out.print(" %p", sample->frames[f]);
+            out.print("\n");
+        }else{
+            for(size_t f = sample->depth; f-- > 0;){
+                print_frame(out, sample->frames[f]);
+                if(f > 0) out.print(";");
+            }
+            out.print(" %.0f\n", group_estimate);
+        }
+    }
+}
+
+bool mem_heap_profile_dump(const char* path, ProfileFormat format){
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) return false;
+    profile_writer out;
+    out.fd = fd;
+    bool written = true;
+
+    in_profiler = true;
+    {
+        std::lock_guard<std::mutex> lock(profile_mutex);
+        //pointers to the live samples, sorted so equal stacks group up
+        size_t count = heap_profile_samples.load(std::memory_order_relaxed);
+        size_t order_bytes = (count > 0 ? count : 1) * sizeof(heap_sample_t*);
+        heap_sample_t** order = (heap_sample_t**)mmap(nullptr, order_bytes, PROT_READ | PROT_WRITE,
+                                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(order == MAP_FAILED){
+            written = false;
+        }else{
+            size_t n = 0;
+            for(size_t i = 0; i < table_slots; i++){
+                if(sample_table[i].ptr != nullptr) order[n++] = &sample_table[i];
+            }
+            std::sort(order, order + n, stack_less);
+            write_samples(out, order, n, format);
+            munmap(order, order_bytes);
+        }
+    }
+    //pprof reads where the frames were loaded from the mappings
+    if(written && format == PROFILE_PPROF){
+        out.print("\nMAPPED_LIBRARIES:\n");
+        out.copy_file("/proc/self/maps");
+    }
+    out.flush();
+    in_profiler = false;
+
+    if(close(fd) != 0) written = false;
+    return written && !out.failed;
+}
@@ -0,0 +1,232 @@
+#include "../include/alloc.hpp"
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <unistd.h>
+
+//Built into libmemcpp_preload.so only. Defines the C allocation functions
+//and the replaceable operator new/delete on top of mem_alloc, so any dynamic
+//binary runs on memcpp with LD_PRELOAD=libmemcpp_preload.so.
+//
+//The dynamic linker calls malloc before any static initializer ran, so the
+//path below may not rely on one: the heaps are constant initialised, the
+//thread caches and counters are trivially destructible thread_locals built
+//with the initial-exec TLS model, and none of it allocates.
+
+static bool is_power_of_two(size_t n){
+    return n != 0 && (n & (n - 1)) == 0;
+}
+
+//malloc and plain operator new only have to align for objects that fit the
+//request, no object of 8 or 24 bytes needs more than 8. Slab objects of such
+//sizes get just that, a caller asking for more goes the aligned way.
+#define MALLOC_ALIGNMENT alignof(void*)
+
+static void* alloc_aligned(size_t size, size_t alignment){
+    if(alignment <= MALLOC_ALIGNMENT) return mem_alloc(size);
+    return mem_alloc_align(size, static_cast<Alignment>(alignment));
+}
+
+//sized free of what alloc_aligned handed out
+static void free_sized_aligned(void* ptr, size_t size, size_t alignment){
+    if(alignment <= MALLOC_ALIGNMENT) mem_free_sized(ptr, size);
+    else mem_free_aligned_sized(ptr, size, static_cast<Alignment>(alignment));
+}
+
+static void* set_errno(void* ptr){
+    if(ptr == nullptr) errno = ENOMEM;
+    return ptr;
+}
+
+extern "C" {
+
+void* malloc(size_t size){
+    return set_errno(mem_alloc(size));
+}
+
+void free(void* ptr){
+    mem_free(ptr);
+}
+
+void* calloc(size_t count, size_t size){
+    return set_errno(mem_calloc(count, size));
+}
+
+void* realloc(void* ptr, size_t size){
+    if(ptr == nullptr) return malloc(size);
+    if(size == 0){
+        mem_free(ptr);
+        return nullptr;
+    }
+    return set_errno(mem_realloc(ptr, size));
+}
+
+void* reallocarray(void* ptr, size_t count, size_t size){
+    size_t bytes;
+    if(__builtin_mul_overflow(count, size, &bytes)){
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return realloc(ptr, bytes);
+}
+
+int posix_memalign(void** out, size_t alignment, size_t size){
+    if(!is_power_of_two(alignment) || alignment % sizeof(void*) != 0) return EINVAL;
+    void* ptr = alloc_aligned(size, alignment);
+    if(ptr == nullptr) return ENOMEM;
+    *out = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size){
+    if(!is_power_of_two(alignment)){
+        errno = EINVAL;
+        return nullptr;
+    }
+    return set_errno(alloc_aligned(size, alignment));
+}
+
+//glibc rounds an alignment that is not a power of two up to the next one
+void* memalign(size_t alignment, size_t size){
+    if(alignment > SIZE_MAX / 2 + 1){
+        errno = EINVAL;
+        return nullptr;
+    }
+    size_t align_val = 1;
+    while(align_val < alignment) align_val <<= 1;
+    return set_errno(alloc_aligned(size, align_val));
+}
+
+void* valloc(size_t size){
+    return memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size){
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    if(size > SIZE_MAX - page_size){
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return memalign(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+size_t malloc_usable_size(void* ptr){
+    return mem_usable_size(ptr);
+}
+
+int malloc_trim(size_t pad){
+    return mem_trim(pad) != 0;
+}
+
+//C23, with the size given to malloc, calloc or realloc
+void free_sized(void* ptr, size_t size){
+    mem_free_sized(ptr, size);
+}
+
+//C23, with the alignment and size given to aligned_alloc
+void free_aligned_sized(void* ptr, size_t alignment, size_t size){
+    free_sized_aligned(ptr, size, alignment);
+}
+
+}
+
+//operator new keeps calling the new_handler until it frees enough memory,
+//then throws
+static void* new_block(size_t size, size_t alignment){
+    for(;;){
+        void* ptr = alloc_aligned(size, alignment);
+        if(ptr != nullptr) return ptr;
+        std::new_handler handler = std::get_new_handler();
+        if(handler == nullptr) throw std::bad_alloc();
+        handler();
+    }
+}
+
+static void* new_block_nothrow(size_t size, size_t alignment) noexcept{
+    try{
+        return new_block(size, alignment);
+    }catch(...){
+        return nullptr;
+    }
+}
+
+void* operator new(size_t size){
+    return new_block(size, MALLOC_ALIGNMENT);
+}
+
+void* operator new[](size_t size){
+    return new_block(size, MALLOC_ALIGNMENT);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept{
+    return new_block_nothrow(size, MALLOC_ALIGNMENT);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept{
+    return new_block_nothrow(size, MALLOC_ALIGNMENT);
+}
+
+void* operator new(size_t size, std::align_val_t alignment){
+    return new_block(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment){
+    return new_block(size, static_cast<size_t>(alignment));
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept{
+    return new_block_nothrow(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept{
+    return new_block_nothrow(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* ptr) noexcept{
+    mem_free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept{
+    mem_free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept{
+    mem_free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept{
+    mem_free(ptr);
+}
+
+void operator delete(void* ptr, size_t size) noexcept{
+    mem_free_sized(ptr, size);
+}
+
+void operator delete[](void* ptr, size_t size) noexcept{
+    mem_free_sized(ptr, size);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept{
+    mem_free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept{
+    mem_free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept{
+    mem_free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept{
+    mem_free(ptr);
+}
+
+void operator delete(void* ptr, size_t size, std::align_val_t alignment) noexcept{
+    free_sized_aligned(ptr, size, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void* ptr, size_t size, std::align_val_t alignment) noexcept{
+    free_sized_aligned(ptr, size, static_cast<size_t>(alignment));
+}
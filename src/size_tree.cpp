@@ -0,0 +1,129 @@
+#include "../include/size_tree.hpp"
+#include <cassert>
+#include <cstddef>
+
+static mem_block_t*& left(mem_block_t* node){
+    return TREE_LINKS(node)->left;
+}
+
+static mem_block_t*& right(mem_block_t* node){
+    return TREE_LINKS(node)->right;
+}
+
+static size_t height(mem_block_t* node){
+    return node == nullptr ? 0 : TREE_LINKS(node)->height;
+}
+
+static bool tree_less(const mem_block_t* a, const mem_block_t* b){
+    size_t size_a = block_size(a);
+    size_t size_b = block_size(b);
+    return size_a != size_b ? size_a < size_b : a < b;
+}
+
+static void update_height(mem_block_t* node){
+    size_t l = height(left(node));
+    size_t r = height(right(node));
+    TREE_LINKS(node)->height = (l > r ? l : r) + 1;
+}
+
+static mem_block_t* rotate_right(mem_block_t* node){
+    mem_block_t* top = left(node);
+    left(node) = right(top);
+    right(top) = node;
+    update_height(node);
+    update_height(top);
+    return top;
+}
+
+static mem_block_t* rotate_left(mem_block_t* node){
+    mem_block_t* top = right(node);
+    right(node) = left(top);
+    left(top) = node;
+    update_height(node);
+    update_height(top);
+    return top;
+}
+
+//restore the AVL property at node after one of its subtrees changed height
+//by one, returns the new root of the subtree
+static mem_block_t* rebalance(mem_block_t* node){
+    update_height(node);
+    size_t l = height(left(node));
+    size_t r = height(right(node));
+    if(l > r + 1){
+        mem_block_t* child = left(node);
+        if(height(left(child)) < height(right(child))) left(node) = rotate_left(child);
+        return rotate_right(node);
+    }
+    if(r > l + 1){
+        mem_block_t* child = right(node);
+        if(height(right(child)) < height(left(child))) right(node) = rotate_right(child);
+        return rotate_left(node);
+    }
+    return node;
+}
+
+static mem_block_t* insert_at(mem_block_t* node, mem_block_t* block){
+    if(node == nullptr){
+        left(block) = nullptr;
+        right(block) = nullptr;
+        TREE_LINKS(block)->height = 1;
+        return block;
+    }
+    mem_block_t*& child = tree_less(block, node) ? left(node) : right(node);
+    size_t before = height(child);
+    child = insert_at(child, block);
+    //nothing further up changes, and the other subtree is never touched
+    if(height(child) == before) return node;
+    return rebalance(node);
+}
+
+static mem_block_t* remove_min(mem_block_t* node, mem_block_t** min){
+    if(left(node) == nullptr){
+        *min = node;
+        return right(node);
+    }
+    size_t before = height(left(node));
+    left(node) = remove_min(left(node), min);
+    if(height(left(node)) == before) return node;
+    return rebalance(node);
+}
+
+static mem_block_t* remove_at(mem_block_t* node, mem_block_t* block){
+    assert(node != nullptr && "block is not in the tree");
+    if(node == block){
+        //the smallest block of the right subtree takes its place
+        if(right(node) == nullptr) return left(node);
+        mem_block_t* successor;
+        mem_block_t* rest = remove_min(right(node), &successor);
+        left(successor) = left(node);
+        right(successor) = rest;
+        return rebalance(successor);
+    }
+    mem_block_t*& child = tree_less(block, node) ? left(node) : right(node);
+    size_t before = height(child);
+    child = remove_at(child, block);
+    if(height(child) == before) return node;
+    return rebalance(node);
+}
+
+void tree_insert(mem_block_t** root, mem_block_t* block){
+    *root = insert_at(*root, block);
+}
+
+void tree_remove(mem_block_t** root, mem_block_t* block){
+    *root = remove_at(*root, block);
+}
+
+mem_block_t* tree_best_fit(mem_block_t* root, size_t size){
+    mem_block_t* best = nullptr;
+    for(mem_block_t* node = root; node != nullptr;){
+        if(block_size(node) >= size){
+            best = node;
+            node = left(node);
+        }else{
+            node = right(node);
+        }
+    }
+    return best;
+}
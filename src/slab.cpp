@@ -0,0 +1,356 @@
+#include "../include/slab.hpp"
+#include "../include/alloc.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SLAB_CLASS_SPAN ((size_t)1 << SLAB_CLASS_SHIFT)
+#define SLABS_PER_CLASS (SLAB_CLASS_SPAN >> SLAB_SHIFT)
+//empty slabs a class keeps backed, the pages of any more are released
+#define SLAB_KEEP_EMPTY 2
+#define SLABS_PER_HUGE_PAGE (MEM_HUGE_PAGE_SIZE / SLAB_SIZE)
+
+//counted together with the heap's, defined in alloc.cpp
+extern std::atomic<size_t> growth_syscalls;
+extern std::atomic<size_t> released_bytes;
+extern std::atomic<HugePages> huge_pages;
+
+enum SlabList { SLAB_PARTIAL, SLAB_FULL, SLAB_EMPTY };
+
+//Descriptor of one slab. It lives in the page map, not in the slab, so the
+//objects take up all of it. Objects past bump were never handed out, freed
+//ones are linked through their first word and marked in free_bits, one bit
+//per 8 bytes of slab, which is what catches a double free.
+typedef struct mem_slab{
+    uint64_t free_bits[SLAB_SIZE / SLAB_GRANULE / 64];
+    void* free_list;
+    char* bump;
+    char* end;
+    size_t used;
+    struct mem_slab* prev; //on the partial or the empty list
+    struct mem_slab* next;
+    SlabList list;
+    bool released;         //empty and its pages given back to the OS
+    uint32_t shard;        //whose lists it is on, fixed once committed
+}mem_slab_t;
+
+//The page map fills the first slabs of every slice. The slabs after it start
+//on a huge page boundary, so with huge pages on a class commits them one
+//huge page at a time.
+#define SLAB_MAP_BYTES (SLABS_PER_CLASS * sizeof(mem_slab_t))
+#define SLAB_MAP_SLABS ((SLAB_MAP_BYTES + MEM_HUGE_PAGE_SIZE - 1) / MEM_HUGE_PAGE_SIZE * SLABS_PER_HUGE_PAGE)
+
+//A class is sharded like the heap. Threads allocate from the shard of their
+//home heap, and a slab stays with the shard that committed it, so its objects
+//are freed back there whichever thread frees them. Refills and flushes of
+//thread caches on different CPUs then take different locks. Only committing
+//a new slab goes through the class's commit lock.
+typedef struct alignas(64) mem_slab_shard{
+    std::mutex mutex;
+    mem_slab_t* partial;  //slabs with room, allocation takes from the first
+    mem_slab_t* empty;
+    size_t empty_count;
+}mem_slab_shard_t;
+
+typedef struct mem_slab_class{
+    mem_slab_shard_t shards[MEM_MAX_HEAPS];
+    std::mutex commit_mutex;
+    size_t next_slab;     //index of the first slab never used
+    size_t commit_end;    //index of the first slab never committed
+    size_t map_committed; //bytes at the start of the page map that are backed
+}mem_slab_class_t;
+
+std::atomic<uintptr_t> slab_base{0};
+std::atomic<uintptr_t> slab_span{0};
+static std::mutex region_mutex;
+static std::atomic<bool> region_failed{false};
+mem_slab_class_t slab_classes[NUM_SLAB_CLASSES];
+
+//Reserve the slices of every class on first use. Only address space, pages
+//are committed slab by slab. False when the range could not be had, small
+//requests then stay on the heap.
+static bool reserve_region(){
+    if(slab_span.load(std::memory_order_acquire) != 0) return true;
+    if(region_failed.load(std::memory_order_relaxed)) return false;
+
+    std::lock_guard<std::mutex> lock(region_mutex);
+    if(slab_span.load(std::memory_order_relaxed) != 0) return true;
+    size_t span = (size_t)NUM_SLAB_CLASSES << SLAB_CLASS_SHIFT;
+    bool huge = huge_pages.load(std::memory_order_relaxed) != HUGE_PAGES_OFF;
+    size_t slack = huge ? MEM_HUGE_PAGE_SIZE : 0;
+    char* mem = (char*)mmap(nullptr, span + slack, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(mem == MAP_FAILED){
+        region_failed.store(true, std::memory_order_relaxed);
+        return false;
+    }
+    if(huge){
+        //slices on huge page boundaries, the flag carries over to whatever
+        //is committed later. Slabs cannot come from the hugetlb pool, a page
+        //it fails to supply would only show as a fault on first touch.
+        char* start = (char*)((reinterpret_cast<uintptr_t>(mem) + slack - 1) & ~(slack - 1));
+        if(start > mem) munmap(mem, start - mem);
+        if(start < mem + slack) munmap(start + span, mem + slack - start);
+        mem = start;
+        madvise(mem, span, MADV_HUGEPAGE);
+    }
+    slab_base.store(reinterpret_cast<uintptr_t>(mem), std::memory_order_relaxed);
+    slab_span.store(span, std::memory_order_release);
+    return true;
+}
+
+static char* class_base(size_t class_index){
+    return (char*)(slab_base.load(std::memory_order_relaxed) + (class_index << SLAB_CLASS_SHIFT));
+}
+
+static mem_slab_t* slab_map(size_t class_index){
+    return (mem_slab_t*)class_base(class_index);
+}
+
+static mem_slab_t* slab_of(const void* ptr, size_t class_index){
+    size_t offset = (const char*)ptr - class_base(class_index);
+    return slab_map(class_index) + (offset >> SLAB_SHIFT);
+}
+
+static char* slab_start(mem_slab_t* slab, size_t class_index){
+    return class_base(class_index) + ((size_t)(slab - slab_map(class_index)) << SLAB_SHIFT);
+}
+
+static mem_slab_shard_t* shard_of(const void* ptr, size_t class_index){
+    return &slab_classes[class_index].shards[slab_of(ptr, class_index)->shard];
+}
+
+//the bit of ptr in free_bits, as a word and a mask
+static uint64_t* free_bit(mem_slab_t* slab, const void* ptr, size_t class_index, uint64_t* mask){
+    size_t granule = (size_t)((const char*)ptr - slab_start(slab, class_index)) / SLAB_GRANULE;
+    *mask = 1ull << (granule % 64);
+    return &slab->free_bits[granule / 64];
+}
+
+static bool commit(char* start, size_t length){
+    if(mprotect(start, length, PROT_READ | PROT_WRITE) != 0) return false;
+    growth_syscalls.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+static void list_push(mem_slab_t** head, mem_slab_t* slab){
+    slab->prev = nullptr;
+    slab->next = *head;
+    if(*head != nullptr) (*head)->prev = slab;
+    *head = slab;
+}
+
+static void list_remove(mem_slab_t** head, mem_slab_t* slab){
+    if(slab->prev != nullptr) slab->prev->next = slab->next;
+    else *head = slab->next;
+    if(slab->next != nullptr) slab->next->prev = slab->prev;
+}
+
+static void slab_reset(mem_slab_t* slab, size_t class_index){
+    char* start = slab_start(slab, class_index);
+    size_t size = slab_class_size(class_index);
+    memset(slab->free_bits, 0, sizeof(slab->free_bits));
+    slab->free_list = nullptr;
+    slab->bump = start;
+    slab->end = start + SLAB_SIZE / size * size;
+    slab->used = 0;
+    slab->released = false;
+}
+
+//the next slab of the class never handed to a shard, nullptr once the slice
+//is used up or the pages cannot be committed. With huge pages the rest of
+//the huge page is committed along with it.
+static mem_slab_t* slab_commit(size_t class_index){
+    mem_slab_class_t* cls = &slab_classes[class_index];
+    std::lock_guard<std::mutex> lock(cls->commit_mutex);
+    if(cls->next_slab == 0) cls->next_slab = cls->commit_end = SLAB_MAP_SLABS;
+    if(cls->next_slab == SLABS_PER_CLASS) return nullptr;
+
+    char* base = class_base(class_index);
+    mem_slab_t* slab = slab_map(class_index) + cls->next_slab;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t map_needed = ((char*)(slab + 1) - base + page_size - 1) & ~(page_size - 1);
+    if(map_needed > cls->map_committed){
+        if(!commit(base + cls->map_committed, map_needed - cls->map_committed)) return nullptr;
+        cls->map_committed = map_needed;
+    }
+    if(cls->next_slab == cls->commit_end){
+        bool huge = huge_pages.load(std::memory_order_relaxed) != HUGE_PAGES_OFF;
+        size_t count = huge ? SLABS_PER_HUGE_PAGE - cls->commit_end % SLABS_PER_HUGE_PAGE : 1;
+        if(!commit(base + (cls->commit_end << SLAB_SHIFT), count << SLAB_SHIFT)) return nullptr;
+        cls->commit_end += count;
+    }
+    cls->next_slab++;
+    return slab;
+}
+
+//a slab with room to allocate from, reused when the shard has an empty one
+static mem_slab_t* slab_next_locked(mem_slab_shard_t* shard, size_t class_index){
+    mem_slab_t* slab = shard->empty;
+    if(slab != nullptr){
+        list_remove(&shard->empty, slab);
+        shard->empty_count--;
+    }else{
+        slab = slab_commit(class_index);
+        if(slab == nullptr) return nullptr;
+        slab->shard = (uint32_t)(shard - slab_classes[class_index].shards);
+    }
+    slab_reset(slab, class_index);
+    slab->list = SLAB_PARTIAL;
+    list_push(&shard->partial, slab);
+    return slab;
+}
+
+static size_t slab_alloc_locked(mem_slab_shard_t* shard, size_t class_index, size_t count, void** out){
+    size_t size = slab_class_size(class_index);
+    size_t n = 0;
+    while(n < count){
+        mem_slab_t* slab = shard->partial;
+        if(slab == nullptr){
+            slab = slab_next_locked(shard, class_index);
+            if(slab == nullptr) break;
+        }
+
+        size_t start = n;
+        while(n < count && slab->free_list != nullptr){
+            void* ptr = slab->free_list;
+            slab->free_list = *(void**)ptr;
+            uint64_t mask;
+            *free_bit(slab, ptr, class_index, &mask) &= ~mask;
+            out[n++] = ptr;
+        }
+        while(n < count && slab->bump < slab->end){
+            out[n++] = slab->bump;
+            slab->bump += size;
+        }
+        slab->used += n - start;
+
+        if(slab->free_list == nullptr && slab->bump == slab->end){
+            list_remove(&shard->partial, slab);
+            slab->list = SLAB_FULL;
+        }
+    }
+    return n;
+}
+
+//Park a slab whose last object was freed. The only slab left to allocate
+//from stays where it is, so a class does not drop and retake one slab as a
+//single object comes and goes.
+static void slab_empty_locked(mem_slab_shard_t* shard, mem_slab_t* slab, size_t class_index){
+    if(shard->partial == slab && slab->next == nullptr) return;
+
+    list_remove(&shard->partial, slab);
+    slab->list = SLAB_EMPTY;
+    list_push(&shard->empty, slab);
+    shard->empty_count++;
+    //with huge pages empty slabs stay, releasing one would split its page
+    if(shard->empty_count > SLAB_KEEP_EMPTY && huge_pages.load(std::memory_order_relaxed) == HUGE_PAGES_OFF){
+        madvise(slab_start(slab, class_index), SLAB_SIZE, MADV_DONTNEED);
+        slab->released = true;
+        released_bytes.fetch_add(SLAB_SIZE, std::memory_order_relaxed);
+    }
+}
+
+static void slab_free_locked(mem_slab_shard_t* shard, void* ptr, size_t class_index){
+    mem_slab_t* slab = slab_of(ptr, class_index);
+    uint64_t mask;
+    uint64_t* bits = free_bit(slab, ptr, class_index, &mask);
+    if(*bits & mask) return; //double free
+    *bits |= mask;
+    *(void**)ptr = slab->free_list;
+    slab->free_list = ptr;
+    if(slab->list == SLAB_FULL){
+        slab->list = SLAB_PARTIAL;
+        list_push(&shard->partial, slab);
+    }
+    if(--slab->used == 0) slab_empty_locked(shard, slab, class_index);
+}
+
+size_t slab_alloc_batch(size_t class_index, size_t count, void** out){
+    if(!reserve_region()) return 0;
+
+    mem_slab_shard_t* shard = &slab_classes[class_index].shards[heap_shard()];
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    return slab_alloc_locked(shard, class_index, count, out);
+}
+
+void slab_free_batch(void** ptrs, size_t count){
+    size_t i = 0;
+    while(i < count){
+        size_t class_index = slab_class_of(ptrs[i]);
+        mem_slab_shard_t* shard = shard_of(ptrs[i], class_index);
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        for(; i < count && slab_class_of(ptrs[i]) == class_index && shard_of(ptrs[i], class_index) == shard; i++){
+            slab_free_locked(shard, ptrs[i], class_index);
+        }
+    }
+}
+
+size_t slab_trim(){
+    if(slab_span.load(std::memory_order_acquire) == 0) return 0;
+
+    size_t released = 0;
+    for(size_t i = 0; i < NUM_SLAB_CLASSES; i++){
+        for(mem_slab_shard_t& shard : slab_classes[i].shards){
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            //the slab kept back by slab_empty_locked goes too
+            mem_slab_t* kept = shard.partial;
+            if(kept != nullptr && kept->used == 0){
+                list_remove(&shard.partial, kept);
+                kept->list = SLAB_EMPTY;
+                list_push(&shard.empty, kept);
+                shard.empty_count++;
+            }
+            for(mem_slab_t* slab = shard.empty; slab != nullptr; slab = slab->next){
+                if(slab->released) continue;
+                madvise(slab_start(slab, i), SLAB_SIZE, MADV_DONTNEED);
+                slab->released = true;
+                released += SLAB_SIZE;
+            }
+        }
+    }
+    return released;
+}
+
+//every shard, then the commit lock, the order slab_next_locked takes them in
+static void lock_class(mem_slab_class_t* cls){
+    for(mem_slab_shard_t& shard : cls->shards) shard.mutex.lock();
+    cls->commit_mutex.lock();
+}
+
+static void unlock_class(mem_slab_class_t* cls){
+    cls->commit_mutex.unlock();
+    for(mem_slab_shard_t& shard : cls->shards) shard.mutex.unlock();
+}
+
+void slab_walk(heap_visitor& visitor){
+    if(slab_span.load(std::memory_order_acquire) == 0) return;
+
+    for(size_t i = 0; i < NUM_SLAB_CLASSES; i++){
+        //the slabs of a class are spread over all its shards
+        lock_class(&slab_classes[i]);
+        mem_slab_t* map = slab_map(i);
+        for(size_t index = SLAB_MAP_SLABS; index < slab_classes[i].next_slab; index++){
+            mem_slab_t* slab = &map[index];
+            if(slab->released) continue;
+            visitor.slab(slab_start(slab, i), slab_class_size(i), slab->used);
+        }
+        unlock_class(&slab_classes[i]);
+    }
+}
+
+//same as the heap locks, none may be held by a thread fork leaves behind
+static void fork_prepare(){
+    region_mutex.lock();
+    for(mem_slab_class_t& cls : slab_classes) lock_class(&cls);
+}
+
+static void fork_release(){
+    for(mem_slab_class_t& cls : slab_classes) unlock_class(&cls);
+    region_mutex.unlock();
+}
+
+static const int fork_handlers = pthread_atfork(fork_prepare, fork_release, fork_release);
@@ -0,0 +1,256 @@
+#include "../include/stats.hpp"
+#include "../include/thread_stats.hpp"
+#include "../include/alloc.hpp"
+#include "../include/heap.hpp"
+#include "../include/slab.hpp"
+#include <cstdarg>
+#include <cstdio>
+#include <mutex>
+#include <pthread.h>
+#include <unistd.h>
+
+//live threads' counters, plus what exited threads left behind
+std::mutex stats_mutex;
+mem_thread_stats_t* stats_head = nullptr;
+mem_thread_stats_t retired_stats;
+
+static void fold_counters(mem_thread_stats_t* into, const mem_thread_stats_t* from){
+    stats_add(into->frees, from->frees.load(std::memory_order_relaxed));
+    stats_add(into->allocated_bytes, from->allocated_bytes.load(std::memory_order_relaxed));
+    stats_add(into->freed_bytes, from->freed_bytes.load(std::memory_order_relaxed));
+    for(size_t i = 0; i < MEM_STATS_BUCKETS; i++){
+        stats_add(into->histogram[i], from->histogram[i].load(std::memory_order_relaxed));
+    }
+}
+
+//Takes a thread's counters out of the registry when it exits. A pthread key
+//rather than a thread_local destructor, registering one of those allocates.
+static pthread_key_t retire_key;
+static pthread_once_t retire_key_once = PTHREAD_ONCE_INIT;
+
+static void stats_retire(void* counters){
+    mem_thread_stats_t* stats = (mem_thread_stats_t*)counters;
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    fold_counters(&retired_stats, stats);
+    if(stats->prev != nullptr) stats->prev->next = stats->next;
+    else stats_head = stats->next;
+    if(stats->next != nullptr) stats->next->prev = stats->prev;
+    stats->active = false;
+    stats->retired = true;
+}
+
+static void create_retire_key(){
+    pthread_key_create(&retire_key, stats_retire);
+}
+
+bool stats_attach(mem_thread_stats_t* stats){
+    if(stats->retired) return false;
+
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        stats->prev = nullptr;
+        stats->next = stats_head;
+        if(stats_head != nullptr) stats_head->prev = stats;
+        stats_head = stats;
+        stats->active = true;
+    }
+    pthread_once(&retire_key_once, create_retire_key);
+    pthread_setspecific(retire_key, stats);
+    return true;
+}
+
+static void fork_prepare(){
+    stats_mutex.lock();
+}
+
+static void fork_release(){
+    stats_mutex.unlock();
+}
+
+static const int fork_handlers = pthread_atfork(fork_prepare, fork_release, fork_release);
+
+void stats_record_retired_alloc(size_t size, size_t usable){
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    stats_add(retired_stats.allocated_bytes, usable);
+    stats_add(retired_stats.histogram[mem_stats_bucket(size)], 1);
+}
+
+void stats_record_retired_free(size_t usable){
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    stats_add(retired_stats.frees, 1);
+    stats_add(retired_stats.freed_bytes, usable);
+}
+
+struct stats_visitor : heap_visitor{
+    mem_stats_t* stats;
+
+    void begin_heap(size_t /*index*/, size_t bytes) override{
+        stats->heap_bytes += bytes;
+    }
+
+    void block(mem_block_t* block) override{
+        stats->block_count++;
+        if(!block_is_free(block)) return;
+        size_t usable = block_size(block) - MEM_BLOCK_SIZE;
+        stats->free_block_count++;
+        stats->bytes_free += usable;
+        if(usable > stats->largest_free_block) stats->largest_free_block = usable;
+    }
+
+    void mmapped(mem_block_t* block) override{
+        stats->block_count++;
+        stats->mmap_bytes += block_size(block);
+    }
+
+    void slab(void* /*start*/, size_t /*object_size*/, size_t /*used*/) override{
+        stats->slab_bytes += SLAB_SIZE;
+    }
+};
+
+mem_stats_t mem_stats(){
+    mem_stats_t stats = {};
+
+    mem_thread_stats_t total = {};
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        fold_counters(&total, &retired_stats);
+        for(mem_thread_stats_t* s = stats_head; s != nullptr; s = s->next){
+            fold_counters(&total, s);
+        }
+    }
+    stats.frees = total.frees.load(std::memory_order_relaxed);
+    stats.bytes_in_use = total.allocated_bytes.load(std::memory_order_relaxed)
+                         - total.freed_bytes.load(std::memory_order_relaxed);
+    for(size_t i = 0; i < MEM_STATS_BUCKETS; i++){
+        stats.histogram[i] = total.histogram[i].load(std::memory_order_relaxed);
+        stats.allocations += stats.histogram[i];
+    }
+
+    stats_visitor visitor;
+    visitor.stats = &stats;
+    heap_walk(visitor);
+    mmap_walk(visitor);
+    slab_walk(visitor);
+    if(stats.bytes_free != 0){
+        stats.fragmentation = 1.0 - (double)stats.largest_free_block / (double)stats.bytes_free;
+    }
+    stats.growth_syscalls = mem_growth_syscalls();
+    stats.released_bytes = mem_released_bytes();
+    return stats;
+}
+
+//Formats into a fixed buffer and writes it out with write(2), the dump runs
+//with heap locks held and stdio could allocate.
+struct dump_visitor : heap_visitor{
+    int fd;
+    DumpFormat format;
+    char buffer[4096];
+    size_t length = 0;
+    bool first_heap = true, first_segment = true, first_block = true;
+
+    void flush(){
+        size_t done = 0;
+        while(done < length){
+            ssize_t n = write(fd, buffer + done, length - done);
+            if(n <= 0) break;
+            done += n;
+        }
+        length = 0;
+    }
+
+    void print(const char* fmt, ...){
+        if(sizeof(buffer) - length < 256) flush();
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(buffer + length, sizeof(buffer) - length, fmt, args);
+        va_end(args);
+        if(n > 0) length += (size_t)n < sizeof(buffer) - length ? n : sizeof(buffer) - length - 1;
+    }
+
+    void begin_heap(size_t index, size_t bytes) override{
+        if(format == DUMP_TEXT){
+            print("heap %zu: %zu bytes\n", index, bytes);
+        }else{
+            print("%s\n    {\"index\": %zu, \"bytes\": %zu, \"segments\": [", first_heap ? "" : ",", index, bytes);
+        }
+        first_heap = false;
+        first_segment = true;
+    }
+
+    void begin_segment(mem_block_t* first) override{
+        if(format == DUMP_TEXT){
+            print("  segment %p\n", (void*)first);
+        }else{
+            print("%s\n      {\"start\": \"%p\", \"blocks\": [", first_segment ? "" : ",", (void*)first);
+        }
+        first_segment = false;
+        first_block = true;
+    }
+
+    void block(mem_block_t* block) override{
+        bool is_free = block_is_free(block);
+        bool trimmed = (block->size_flags & BLOCK_TRIMMED) != 0;
+        if(format == DUMP_TEXT){
+            print("    %p %zu %s%s\n", block_payload(block), block_size(block),
+                  is_free ? "free" : "used", trimmed ? " trimmed" : "");
+        }else{
+            print("%s\n        {\"address\": \"%p\", \"size\": %zu, \"free\": %s, \"trimmed\": %s}",
+                  first_block ? "" : ",", block_payload(block), block_size(block),
+                  is_free ? "true" : "false", trimmed ? "true" : "false");
+        }
+        first_block = false;
+    }
+
+    void end_segment() override{
+        if(format == DUMP_JSON) print("\n      ]}");
+    }
+
+    void end_heap() override{
+        if(format == DUMP_JSON) print("\n    ]}");
+    }
+
+    void mmapped(mem_block_t* block) override{
+        if(format == DUMP_TEXT){
+            print("  %p %zu used\n", block_payload(block), block_size(block));
+        }else{
+            print("%s\n    {\"address\": \"%p\", \"size\": %zu}", first_block ? "" : ",",
+                  block_payload(block), block_size(block));
+        }
+        first_block = false;
+    }
+
+    void slab(void* start, size_t object_size, size_t used) override{
+        if(format == DUMP_TEXT){
+            print("  %p %zu byte objects, %zu of %zu used\n", start, object_size, used, SLAB_SIZE / object_size);
+        }else{
+            print("%s\n    {\"address\": \"%p\", \"object_size\": %zu, \"objects\": %zu, \"used\": %zu}",
+                  first_block ? "" : ",", start, object_size, SLAB_SIZE / object_size, used);
+        }
+        first_block = false;
+    }
+};
+
+void mem_dump_heap(int fd, DumpFormat format){
+    dump_visitor visitor;
+    visitor.fd = fd;
+    visitor.format = format;
+
+    if(format == DUMP_JSON) visitor.print("{\n  \"heaps\": [");
+    heap_walk(visitor);
+    if(format == DUMP_TEXT){
+        visitor.print("mmapped:\n");
+    }else{
+        visitor.print("\n  ],\n  \"mmapped\": [");
+    }
+    visitor.first_block = true;
+    mmap_walk(visitor);
+    if(format == DUMP_TEXT){
+        visitor.print("slabs:\n");
+    }else{
+        visitor.print("\n  ],\n  \"slabs\": [");
+    }
+    visitor.first_block = true;
+    slab_walk(visitor);
+    if(format == DUMP_JSON) visitor.print("\n  ]\n}\n");
+    visitor.flush();
+}
@@ -0,0 +1,172 @@
+#include "../include/thread_cache.hpp"
+#include "../include/heap.hpp"
+#include "../include/slab.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <pthread.h>
+
+#define TCACHE_BATCH_SIZE 16
+
+constinit thread_local thread_cache mem_tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static void tcache_push(tcache_bin_t* bin, void* ptr, bool keyed = true){
+    tcache_entry_t* entry = (tcache_entry_t*)ptr;
+    entry->next = bin->head;
+    if(keyed) entry->key = &mem_tcache;
+    bin->head = entry;
+    bin->count++;
+}
+
+static void* tcache_pop(tcache_bin_t* bin, bool keyed = true){
+    tcache_entry_t* entry = bin->head;
+    bin->head = entry->next;
+    bin->count--;
+    if(keyed) entry->key = nullptr;
+    return entry;
+}
+
+//return half of a full bin to the heap under a single lock acquisition
+static void tcache_flush(tcache_bin_t* bin, size_t count){
+    void* batch[TCACHE_BIN_CAPACITY];
+    size_t n = 0;
+    while(n < count && bin->head != nullptr){
+        batch[n++] = tcache_pop(bin);
+    }
+    heap_free_batch(batch, n);
+}
+
+static void tcache_slab_flush(tcache_bin_t* bin, size_t class_index, size_t count){
+    void* batch[TCACHE_BIN_CAPACITY];
+    size_t n = 0;
+    while(n < count && bin->head != nullptr){
+        batch[n++] = tcache_pop(bin, tcache_slab_keyed(class_index));
+    }
+    slab_free_batch(batch, n);
+}
+
+static void flush_bins(thread_cache* cache){
+    for(size_t i = 0; i < NUM_SIZE_CLASSES; i++){
+        while(cache->bins[i].count > 0){
+            tcache_flush(&cache->bins[i], TCACHE_BIN_CAPACITY);
+        }
+    }
+    for(size_t i = 0; i < NUM_SLAB_CLASSES; i++){
+        while(cache->slab_bins[i].count > 0){
+            tcache_slab_flush(&cache->slab_bins[i], i, TCACHE_BIN_CAPACITY);
+        }
+    }
+}
+
+//Runs after the thread's own thread_local destructors, anything they freed
+//is flushed too. Frees that come later still go straight to the heap.
+static void tcache_exit(void* cache){
+    thread_cache* c = (thread_cache*)cache;
+    flush_bins(c);
+    c->state = TCACHE_EXITED;
+}
+
+static void create_tcache_key(){
+    pthread_key_create(&tcache_key, tcache_exit);
+}
+
+//false once the thread is exiting and blocks must bypass the cache
+static bool tcache_register(){
+    if(mem_tcache.state == TCACHE_EXITED) return false;
+    pthread_once(&tcache_key_once, create_tcache_key);
+    pthread_setspecific(tcache_key, &mem_tcache);
+    mem_tcache.state = TCACHE_ACTIVE;
+    return true;
+}
+
+void tcache_flush_all(){
+    flush_bins(&mem_tcache);
+}
+
+void* tcache_alloc(size_t class_index){
+    tcache_bin_t* bin = &mem_tcache.bins[class_index];
+    if(bin->head != nullptr){
+        return tcache_pop(bin);
+    }
+
+    //miss, refill a batch from the heap
+    void* batch[TCACHE_BATCH_SIZE];
+    if(mem_tcache.state != TCACHE_ACTIVE && !tcache_register()){
+        return heap_alloc_batch(size_class_size(class_index), 1, batch) == 1 ? batch[0] : nullptr;
+    }
+    size_t n = heap_alloc_batch(size_class_size(class_index), TCACHE_BATCH_SIZE, batch);
+    if(n == 0) return nullptr;
+    for(size_t i = 1; i < n; i++){
+        tcache_push(bin, batch[i]);
+    }
+    return batch[0];
+}
+
+void* tcache_alloc_aligned(size_t class_index, size_t align_val){
+    tcache_bin_t* bin = &mem_tcache.bins[class_index];
+    if(bin->head != nullptr && (reinterpret_cast<uintptr_t>(bin->head) & (align_val - 1)) == 0){
+        return tcache_pop(bin);
+    }
+    return nullptr;
+}
+
+void tcache_free(void* ptr, size_t class_index){
+    if(mem_tcache.state != TCACHE_ACTIVE && !tcache_register()){
+        heap_free_batch(&ptr, 1);
+        return;
+    }
+    tcache_bin_t* bin = &mem_tcache.bins[class_index];
+
+    //the key only hints at a double free, confirm by walking the bin
+    if(((tcache_entry_t*)ptr)->key == &mem_tcache){
+        for(tcache_entry_t* e = bin->head; e != nullptr; e = e->next){
+            if(e == ptr) return;
+        }
+    }
+
+    if(bin->count >= TCACHE_BIN_CAPACITY){
+        tcache_flush(bin, TCACHE_BIN_CAPACITY / 2);
+    }
+    tcache_push(bin, ptr);
+}
+
+void* tcache_slab_alloc(size_t class_index){
+    void* ptr = tcache_slab_pop(class_index);
+    if(ptr != nullptr) return ptr;
+
+    tcache_bin_t* bin = &mem_tcache.slab_bins[class_index];
+    bool keyed = tcache_slab_keyed(class_index);
+    void* batch[TCACHE_BATCH_SIZE];
+    if(mem_tcache.state != TCACHE_ACTIVE && !tcache_register()){
+        return slab_alloc_batch(class_index, 1, batch) == 1 ? batch[0] : nullptr;
+    }
+    size_t n = slab_alloc_batch(class_index, TCACHE_BATCH_SIZE, batch);
+    if(n == 0) return nullptr;
+    for(size_t i = 1; i < n; i++){
+        tcache_push(bin, batch[i], keyed);
+    }
+    return batch[0];
+}
+
+void tcache_slab_free(void* ptr, size_t class_index){
+    if(tcache_slab_push(ptr, class_index)) return;
+    if(mem_tcache.state != TCACHE_ACTIVE && !tcache_register()){
+        slab_free_batch(&ptr, 1);
+        return;
+    }
+    tcache_bin_t* bin = &mem_tcache.slab_bins[class_index];
+    bool keyed = tcache_slab_keyed(class_index);
+
+    //without a key only a free of the most recently cached object is caught
+    if(keyed ? ((tcache_entry_t*)ptr)->key == &mem_tcache : bin->head == ptr){
+        for(tcache_entry_t* e = bin->head; e != nullptr; e = e->next){
+            if(e == ptr) return;
+        }
+    }
+
+    if(bin->count >= TCACHE_BIN_CAPACITY){
+        tcache_slab_flush(bin, class_index, TCACHE_BIN_CAPACITY / 2);
+    }
+    tcache_push(bin, ptr, keyed);
+}
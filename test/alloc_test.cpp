@@ -1,15 +1,68 @@
 #include <gtest/gtest.h>
 #include "../include/alloc.hpp"
+#include "../include/block.hpp"
+#include "../include/stats.hpp"
+#include "../include/slab.hpp"
+#include <algorithm>
 #include <cstring>
 #include <cstdint>
 #include <vector>
 #include <thread>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
 
 // Helper function to check if pointer is aligned
 bool is_aligned(void* ptr, size_t alignment) {
     return (reinterpret_cast<uintptr_t>(ptr) % alignment) == 0;
 }
 
+// Resident set size of this process in bytes
+static size_t resident_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    size_t total_pages = 0, resident_pages = 0;
+    statm >> total_pages >> resident_pages;
+    return resident_pages * sysconf(_SC_PAGESIZE);
+}
+
+// Allocate blocks of size bytes until the heap grows. No free block left
+// behind can take another one, so the next come from the new memory.
+static std::vector<void*> fill_until_growth(size_t size) {
+    std::vector<void*> fillers;
+    size_t syscalls_before = mem_growth_syscalls();
+    while(mem_growth_syscalls() == syscalls_before) {
+        void* ptr = mem_alloc(size);
+        if(ptr == nullptr) break;
+        fillers.push_back(ptr);
+    }
+    return fillers;
+}
+
+// VmFlags of the mapping that holds ptr, empty when there is none
+static std::string mapping_flags(const void* ptr) {
+    std::ifstream smaps("/proc/self/smaps");
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    bool inside = false;
+    std::string line;
+    while(std::getline(smaps, line)) {
+        unsigned long start, end;
+        char dash;
+        std::istringstream header(line);
+        if(header >> std::hex >> start >> dash >> end && dash == '-') {
+            inside = start <= addr && addr < end;
+        } else if(inside && line.rfind("VmFlags:", 0) == 0) {
+            return line;
+        }
+    }
+    return "";
+}
+
+static bool thp_supported() {
+    return access("/sys/kernel/mm/transparent_hugepage/enabled", F_OK) == 0;
+}
+
 // ============================================================================
 // Basic Allocation Tests
 // ============================================================================
@@ -211,6 +264,43 @@ TEST(AllocTest, AlignedAllocation_Various) {
     }
 }
 
+TEST(AllocTest, AlignedAllocation_NoOverAllocation) {
+    // An aligned block is carved at the aligned address, the slack in front
+    // of it goes back to the heap instead of being kept by the block
+    void* ptr = mem_alloc_align(64, ALIGN_1024);
+    ASSERT_NE(ptr, nullptr);
+    EXPECT_TRUE(is_aligned(ptr, 1024));
+    EXPECT_LT(mem_usable_size(ptr), 64u + 32u);
+    mem_free(ptr);
+}
+
+TEST(AllocTest, AlignedAllocation_CacheLineCounters) {
+    std::vector<void*> counters;
+    for(int i = 0; i < 256; i++) {
+        void* ptr = mem_alloc_align(sizeof(uint64_t), ALIGN_64);
+        ASSERT_NE(ptr, nullptr);
+        EXPECT_TRUE(is_aligned(ptr, 64));
+        *static_cast<uint64_t*>(ptr) = i;
+        counters.push_back(ptr);
+    }
+    for(int i = 0; i < 256; i++) {
+        EXPECT_EQ(*static_cast<uint64_t*>(counters[i]), (uint64_t)i);
+        mem_free(counters[i]);
+    }
+}
+
+TEST(AllocTest, AlignedAllocation_PageBuffers) {
+    // Page aligned I/O buffers, on the heap and through mmap
+    for(size_t size : {4096, 64 * 1024, 1024 * 1024}) {
+        void* ptr = mem_alloc_align(size, ALIGN_4096);
+        ASSERT_NE(ptr, nullptr);
+        EXPECT_TRUE(is_aligned(ptr, 4096));
+        EXPECT_GE(mem_usable_size(ptr), size);
+        memset(ptr, 0x99, size);
+        mem_free(ptr);
+    }
+}
+
 // TEST(AllocTest, AlignedAllocation_TypeBased) {
 //     // Test type-based alignment
 //     //void* char_ptr = mem_alloc_align_type(100, ALIGN_CHAR);
@@ -339,4 +429,1336 @@ TEST(AllocTest, VerySmallAllocation) {
     EXPECT_EQ(*byte, 0x42);
     
     mem_free(ptr);
-}
\ No newline at end of file
+}
+
+// ============================================================================
+// Free List Bin Tests
+// ============================================================================
+
+TEST(BinTest, ReusesFreedBlockOfSameSize) {
+    // Above the thread cache limit, goes straight to the heap bins.
+    // Guards on both sides keep the freed block from coalescing.
+    void* guard_before = mem_alloc(8192);
+    void* ptr1 = mem_alloc(8192);
+    void* guard_after = mem_alloc(8192);
+    ASSERT_NE(ptr1, nullptr);
+
+    mem_free(ptr1);
+    // Blocks left free by earlier tests may fit as well, and the guards may
+    // have come from some of them, letting ptr1 merge with free space around
+    // it. Either way its memory must be handed out again before the heap grows.
+    auto holds_ptr1 = [ptr1](void* ptr) {
+        return (char*)ptr <= (char*)ptr1 && (char*)ptr1 < (char*)ptr + 8192;
+    };
+    std::vector<void*> others;
+    void* ptr2 = mem_alloc(8192);
+    while(!holds_ptr1(ptr2) && others.size() < 1000) {
+        others.push_back(ptr2);
+        ptr2 = mem_alloc(8192);
+    }
+    EXPECT_TRUE(holds_ptr1(ptr2));
+
+    mem_free(ptr2);
+    for(void* ptr : others) {
+        mem_free(ptr);
+    }
+    mem_free(guard_before);
+    mem_free(guard_after);
+}
+
+TEST(BinTest, FindsFitAmongManyLiveBlocks) {
+    const int count = 20000;
+    std::vector<void*> ptrs;
+    for(int i = 0; i < count; i++) {
+        ptrs.push_back(mem_alloc(2048 + (i % 4) * 512));
+        ASSERT_NE(ptrs.back(), nullptr);
+    }
+
+    // Punch holes of every size into the heap
+    for(int i = 0; i < count; i += 2) {
+        mem_free(ptrs[i]);
+        ptrs[i] = nullptr;
+    }
+
+    // Every hole is reusable
+    for(int i = 0; i < count; i += 2) {
+        ptrs[i] = mem_alloc(2048 + (i % 4) * 512);
+        ASSERT_NE(ptrs[i], nullptr);
+        memset(ptrs[i], 0x3C, 2048);
+    }
+
+    for(void* ptr : ptrs) {
+        mem_free(ptr);
+    }
+}
+
+TEST(BinTest, TakesTheClosestFitNotTheFirst) {
+    // A free block left by an earlier test could fit closer than either,
+    // lay the blocks out in new memory
+    std::vector<void*> fillers = fill_until_growth(2048);
+    void* close = mem_alloc(8200);
+    void* guard1 = mem_alloc(2048);
+    void* loose = mem_alloc(10000);
+    void* guard2 = mem_alloc(2048);
+
+    // the looser block is the more recently freed one
+    mem_free(close);
+    mem_free(loose);
+    EXPECT_EQ(mem_alloc(8192), close);
+    EXPECT_EQ(mem_alloc(9000), loose);
+
+    mem_free(close);
+    mem_free(loose);
+    mem_free(guard1);
+    mem_free(guard2);
+    for(void* ptr : fillers) {
+        mem_free(ptr);
+    }
+}
+
+TEST(BinTest, EqualSizesGoLowestAddressFirst) {
+    // Free blocks left by earlier tests would be taken first, lay the blocks
+    // out in new memory
+    std::vector<void*> fillers = fill_until_growth(2048);
+    void* ptrs[6];
+    void* guards[6];
+    for(int i = 0; i < 6; i++) {
+        ptrs[i] = mem_alloc(4000);
+        guards[i] = mem_alloc(2048);
+    }
+    for(int i = 5; i >= 0; i--) {
+        mem_free(ptrs[i]);
+    }
+
+    std::vector<void*> sorted(ptrs, ptrs + 6);
+    std::sort(sorted.begin(), sorted.end());
+    for(void* expected : sorted) {
+        EXPECT_EQ(mem_alloc(4000), expected);
+    }
+
+    for(int i = 0; i < 6; i++) {
+        mem_free(ptrs[i]);
+        mem_free(guards[i]);
+    }
+    for(void* ptr : fillers) {
+        mem_free(ptr);
+    }
+}
+
+TEST(BinTest, BestFitAmongManyFreeSizes) {
+    // One growth covers the whole layout, so every block is carved right
+    // after the one before it and each freed block is kept apart by a guard.
+    // Every request below then has a block of exactly its size waiting,
+    // whatever order the tree saw them in. The fillers use up the free
+    // blocks earlier tests left that could take any of them.
+    mem_config_t saved = mem_get_config();
+    mem_config_t config = saved;
+    config.heap_growth_min = 32 * 1024 * 1024;
+    mem_configure(config);
+    std::vector<void*> fillers = fill_until_growth(1100);
+
+    const int count = 500;
+    std::vector<size_t> sizes;
+    std::vector<void*> ptrs, guards;
+    for(int i = 0; i < count; i++) {
+        sizes.push_back(1100 + (size_t)(i * 7919) % 30000);
+        ptrs.push_back(mem_alloc(sizes.back()));
+        guards.push_back(mem_alloc(2048));
+    }
+    std::vector<size_t> usable;
+    for(void* ptr : ptrs) usable.push_back(mem_usable_size(ptr));
+    std::vector<int> order(count);
+    for(int i = 0; i < count; i++) order[i] = (i * 137) % count;
+    for(int i : order) {
+        mem_free(ptrs[i]);
+    }
+
+    for(int i = count - 1; i >= 0; i--) {
+        int index = order[i];
+        void* ptr = mem_alloc(sizes[index]);
+        ASSERT_NE(ptr, nullptr);
+        EXPECT_EQ(mem_usable_size(ptr), usable[index]) << sizes[index];
+        ptrs[index] = ptr;
+    }
+
+    for(int i = 0; i < count; i++) {
+        mem_free(ptrs[i]);
+        mem_free(guards[i]);
+    }
+    for(void* ptr : fillers) {
+        mem_free(ptr);
+    }
+    mem_configure(saved);
+}
+
+// ============================================================================
+// Heap Growth Tests
+// ============================================================================
+
+TEST(GrowthTest, ManySmallAllocationsGrowInChunks) {
+    const int count = 10000;
+    size_t syscalls_before = mem_growth_syscalls();
+
+    std::vector<void*> ptrs;
+    for(int i = 0; i < count; i++) {
+        ptrs.push_back(mem_alloc(2000));
+        ASSERT_NE(ptrs.back(), nullptr);
+    }
+    size_t growth_calls = mem_growth_syscalls() - syscalls_before;
+
+    // ~20 MB of blocks, one sbrk per block would be 10000 calls. Doubling
+    // from 64 KB gets there in 10, a couple more if sbrk fell short.
+    EXPECT_LE(growth_calls, 12u);
+
+    for(void* ptr : ptrs) {
+        mem_free(ptr);
+    }
+}
+
+TEST(GrowthTest, SurplusIsReused) {
+    mem_config_t saved = mem_get_config();
+    mem_config_t config = saved;
+    config.heap_growth_min = 1024 * 1024;
+    mem_configure(config);
+
+    void* first = mem_alloc(4096);
+    ASSERT_NE(first, nullptr);
+
+    // Served from the rest of the chunk without growing again
+    size_t syscalls_before = mem_growth_syscalls();
+    void* second = mem_alloc(4096);
+    ASSERT_NE(second, nullptr);
+    EXPECT_EQ(mem_growth_syscalls(), syscalls_before);
+
+    mem_free(first);
+    mem_free(second);
+    mem_configure(saved);
+}
+
+// ============================================================================
+// Large (mmap) Allocation Tests
+// ============================================================================
+
+TEST(MmapTest, LargeFreesReturnMemoryToOS) {
+    const size_t large_size = 8 * 1024 * 1024;
+    size_t rss_before = resident_bytes();
+
+    for(int i = 0; i < 32; i++) {
+        void* ptr = mem_alloc(large_size);
+        ASSERT_NE(ptr, nullptr);
+        memset(ptr, 0x7E, large_size);
+        mem_free(ptr);
+    }
+
+    // 256 MB went through the allocator, none of it should stay resident
+    EXPECT_LT(resident_bytes(), rss_before + 2 * large_size);
+}
+
+TEST(MmapTest, ThresholdIsConfigurable) {
+    mem_config_t saved = mem_get_config();
+
+    mem_config_t config = saved;
+    config.mmap_threshold = 16 * 1024;
+    mem_configure(config);
+    EXPECT_EQ(mem_get_config().mmap_threshold, 16 * 1024u);
+
+    void* ptr = mem_alloc(32 * 1024);
+    ASSERT_NE(ptr, nullptr);
+    memset(ptr, 0x21, 32 * 1024);
+    mem_free(ptr);
+
+    mem_configure(saved);
+}
+
+TEST(MmapTest, AlignedLargeAllocation) {
+    void* ptr = mem_alloc_align(1024 * 1024, ALIGN_1024);
+    ASSERT_NE(ptr, nullptr);
+    EXPECT_TRUE(is_aligned(ptr, 1024));
+    memset(ptr, 0x42, 1024 * 1024);
+    mem_free(ptr);
+}
+
+// ============================================================================
+// Trim Tests
+// ============================================================================
+
+TEST(TrimTest, ReleasesFreeInteriorPages) {
+    mem_config_t saved = mem_get_config();
+    mem_config_t config = saved;
+    config.trim_threshold = 0;
+    mem_configure(config);
+
+    // 8 MB of heap blocks, kept from the end of the heap by a live guard
+    std::vector<void*> ptrs;
+    for(int i = 0; i < 1024; i++) {
+        ptrs.push_back(mem_alloc(8192));
+        ASSERT_NE(ptrs.back(), nullptr);
+        memset(ptrs.back(), 0x1F, 8192);
+    }
+    void* guard = mem_alloc(8192);
+    for(void* ptr : ptrs) {
+        mem_free(ptr);
+    }
+
+    size_t rss_before = resident_bytes();
+    size_t released_before = mem_released_bytes();
+    size_t released = mem_trim();
+
+    EXPECT_GE(released, 4u * 1024 * 1024);
+    EXPECT_EQ(mem_released_bytes() - released_before, released);
+    EXPECT_LT(resident_bytes(), rss_before);
+
+    // Released pages are still usable afterwards
+    void* reuse = mem_alloc(64 * 1024);
+    ASSERT_NE(reuse, nullptr);
+    memset(reuse, 0x2E, 64 * 1024);
+    mem_free(reuse);
+
+    mem_free(guard);
+    mem_configure(saved);
+}
+
+TEST(TrimTest, AutomaticTrimShrinksBreak) {
+    std::vector<void*> ptrs;
+    for(int i = 0; i < 512; i++) {
+        ptrs.push_back(mem_alloc(8192));
+        ASSERT_NE(ptrs.back(), nullptr);
+    }
+    void* brk_grown = sbrk(0);
+    size_t released_before = mem_released_bytes();
+
+    // Freeing from the top down leaves one big free block at the end
+    for(int i = 511; i >= 0; i--) {
+        mem_free(ptrs[i]);
+    }
+
+    if(sbrk(0) >= brk_grown) {
+        // Someone else owns the break above us, only mem_trim can give the
+        // freed blocks back, page by page
+        EXPECT_GE(mem_trim(), 256 * 8192u);
+    }
+    EXPECT_GT(mem_released_bytes(), released_before);
+}
+
+TEST(TrimTest, TrimOnEmptyHeap) {
+    size_t released_before = mem_released_bytes();
+    size_t released = mem_trim();
+    EXPECT_EQ(mem_released_bytes(), released_before + released);
+
+    // Nothing was freed since, a second pass has nothing left to give back
+    EXPECT_EQ(mem_trim(1024 * 1024), 0u);
+    EXPECT_EQ(mem_released_bytes(), released_before + released);
+}
+
+// ============================================================================
+// Huge Page Tests
+// ============================================================================
+
+TEST(HugePageTest, HeapGrowsInHugePageRegions) {
+    mem_config_t saved = mem_get_config();
+    mem_config_t config = saved;
+    config.huge_pages = HUGE_PAGES_MADVISE;
+    mem_configure(config);
+    EXPECT_EQ(mem_get_config().huge_pages, HUGE_PAGES_MADVISE);
+
+    // Earlier tests may leave free space behind, fill it until the heap grows.
+    // The block that made it grow is in the new region.
+    size_t heap_before = mem_stats().heap_bytes;
+    std::vector<void*> ptrs = fill_until_growth(16 * 1024);
+    ASSERT_FALSE(ptrs.empty());
+    memset(ptrs.back(), 0x5A, 16 * 1024);
+    size_t grown = mem_stats().heap_bytes - heap_before;
+    EXPECT_GE(grown, MEM_HUGE_PAGE_SIZE);
+    EXPECT_EQ(grown % MEM_HUGE_PAGE_SIZE, 0u);
+    if(thp_supported()) {
+        EXPECT_NE(mapping_flags(ptrs.back()).find(" hg"), std::string::npos);
+    }
+
+    for(void* ptr : ptrs) {
+        mem_free(ptr);
+    }
+    mem_configure(saved);
+}
+
+TEST(HugePageTest, CallocZeroesReusedRegions) {
+    mem_config_t saved = mem_get_config();
+    mem_config_t config = saved;
+    config.huge_pages = HUGE_PAGES_MADVISE;
+    mem_configure(config);
+
+    // Several regions, the later ones usually mapped below the earlier
+    std::vector<void*> ptrs;
+    for(int i = 0; i < 512; i++) {
+        ptrs.push_back(mem_alloc(16 * 1024));
+        ASSERT_NE(ptrs.back(), nullptr);
+        memset(ptrs.back(), 0xFF, 16 * 1024);
+    }
+    void* tail = mem_alloc(4 * 1024 * 1024);
+    ASSERT_NE(tail, nullptr);
+    for(void* ptr : ptrs) {
+        mem_free(ptr);
+    }
+
+    for(void*& ptr : ptrs) {
+        ptr = mem_calloc(16 * 1024, 1);
+        ASSERT_NE(ptr, nullptr);
+        const unsigned char* bytes = static_cast<const unsigned char*>(ptr);
+        for(size_t i = 0; i < 16 * 1024; i++) {
+            ASSERT_EQ(bytes[i], 0) << "byte " << i;
+        }
+    }
+    for(void* ptr : ptrs) {
+        mem_free(ptr);
+    }
+    mem_free(tail);
+    mem_configure(saved);
+}
+
+TEST(HugePageTest, SlabsAreBackedByHugePages) {
+    if(!thp_supported()) GTEST_SKIP() << "no transparent huge pages";
+
+    // The slab range is reserved on the first small allocation, so check it
+    // in a freshly started process where none has happened yet
+    testing::FLAGS_gtest_death_test_style = "threadsafe";
+    EXPECT_EXIT({
+        mem_config_t config = mem_get_config();
+        config.huge_pages = HUGE_PAGES_MADVISE;
+        mem_configure(config);
+        void* ptr = mem_alloc(64);
+        bool huge = slab_contains(ptr) && mapping_flags(ptr).find(" hg") != std::string::npos;
+        _exit(huge ? 0 : 1);
+    }, testing::ExitedWithCode(0), "");
+}
+
+TEST(HugePageTest, HugetlbFallsBackWhenThePoolIsShort) {
+    mem_config_t saved = mem_get_config();
+    mem_config_t config = saved;
+    config.huge_pages = HUGE_PAGES_HUGETLB;
+    mem_configure(config);
+
+    // Whatever the pool holds, every request is served
+    std::vector<void*> ptrs;
+    for(size_t size : {16, 200, 4096, 64 * 1024, 100 * 1024}) {
+        for(int i = 0; i < 64; i++) {
+            void* ptr = mem_alloc(size);
+            ASSERT_NE(ptr, nullptr);
+            memset(ptr, 0x6B, size);
+            ptrs.push_back(ptr);
+        }
+    }
+    for(void* ptr : ptrs) {
+        mem_free(ptr);
+    }
+    mem_configure(saved);
+}
+
+TEST(HugePageTest, TrimReleasesWholeHugePages) {
+    mem_config_t saved = mem_get_config();
+    mem_config_t config = saved;
+    config.huge_pages = HUGE_PAGES_MADVISE;
+    config.trim_threshold = 0;
+    config.heap_growth_min = 32 * 1024 * 1024;
+    mem_configure(config);
+
+    // 8 MB of heap blocks in one new region, kept from the end of the heap
+    // by a live guard
+    std::vector<void*> fillers = fill_until_growth(8192);
+    std::vector<void*> ptrs;
+    for(int i = 0; i < 1024; i++) {
+        ptrs.push_back(mem_alloc(8192));
+        ASSERT_NE(ptrs.back(), nullptr);
+        memset(ptrs.back(), 0x1F, 8192);
+    }
+    void* guard = mem_alloc(8192);
+    for(void* ptr : ptrs) {
+        mem_free(ptr);
+    }
+
+    // the region holding the 8 MB has at least 2 whole huge pages free
+    size_t released = mem_trim();
+    EXPECT_GE(released, 2 * MEM_HUGE_PAGE_SIZE);
+
+    void* reuse = mem_alloc(64 * 1024);
+    ASSERT_NE(reuse, nullptr);
+    memset(reuse, 0x2E, 64 * 1024);
+    mem_free(reuse);
+    mem_free(guard);
+    for(void* ptr : fillers) {
+        mem_free(ptr);
+    }
+    mem_configure(saved);
+}
+
+// ============================================================================
+// Calloc Tests
+// ============================================================================
+
+static bool all_zero(void* ptr, size_t size) {
+    unsigned char* bytes = (unsigned char*)ptr;
+    for(size_t i = 0; i < size; i++) {
+        if(bytes[i] != 0) return false;
+    }
+    return true;
+}
+
+TEST(CallocTest, OverflowReturnsNull) {
+    EXPECT_EQ(mem_calloc(SIZE_MAX / 2, 3), nullptr);
+    EXPECT_EQ(mem_calloc((size_t)1 << 33, (size_t)1 << 33), nullptr);
+}
+
+TEST(CallocTest, ReusedMemoryIsZeroed) {
+    for(size_t size : {24, 1000, 5000, 60000, 200000}) {
+        void* dirty = mem_alloc(size);
+        ASSERT_NE(dirty, nullptr);
+        memset(dirty, 0xCD, size);
+        mem_free(dirty);
+
+        void* ptr = mem_calloc(1, size);
+        ASSERT_NE(ptr, nullptr);
+        EXPECT_TRUE(all_zero(ptr, size)) << size;
+        memset(ptr, 0xCD, size);
+        mem_free(ptr);
+    }
+}
+
+TEST(CallocTest, MixedTraceStaysZeroed) {
+    // frees, splits, coalescing and trims around the untouched mark
+    std::vector<std::pair<void*, size_t>> live;
+    unsigned seed = 7;
+    for(int i = 0; i < 4000; i++) {
+        seed = seed * 1103515245 + 12345;
+        if(live.size() < 64 && (seed >> 8) % 3 != 0) {
+            size_t size = 1100 + (seed >> 4) % 40000;
+            void* ptr = (seed >> 12) % 2 ? mem_calloc(size, 1) : mem_alloc(size);
+            ASSERT_NE(ptr, nullptr);
+            if((seed >> 12) % 2) {
+                ASSERT_TRUE(all_zero(ptr, size));
+            }
+            memset(ptr, 0xEE, size);
+            live.push_back({ptr, size});
+        } else if(!live.empty()) {
+            size_t j = (seed >> 8) % live.size();
+            if((seed >> 16) % 4 == 0) {
+                size_t size = 1100 + (seed >> 3) % 60000;
+                void* ptr = mem_realloc(live[j].first, size);
+                ASSERT_NE(ptr, nullptr);
+                memset(ptr, 0xEE, size);
+                live[j] = {ptr, size};
+                continue;
+            }
+            mem_free(live[j].first);
+            live[j] = live.back();
+            live.pop_back();
+        }
+    }
+    for(auto& entry : live) mem_free(entry.first);
+}
+
+TEST(CallocTest, FreshHeapMemoryIsNotTouched) {
+    mem_config_t saved = mem_get_config();
+    mem_config_t config = saved;
+    config.heap_growth_min = 64 * 1024 * 1024;
+    mem_configure(config);
+
+    // 100 blocks of 100 KB straight out of a fresh heap chunk stay mostly
+    // unmapped when nothing clears them
+    std::vector<void*> fillers = fill_until_growth(100 * 1024);
+    size_t rss_before = resident_bytes();
+    std::vector<void*> ptrs;
+    for(int i = 0; i < 100; i++) {
+        void* ptr = mem_calloc(100 * 1024, 1);
+        ASSERT_NE(ptr, nullptr);
+        ptrs.push_back(ptr);
+    }
+    EXPECT_LT(resident_bytes(), rss_before + 4 * 1024 * 1024);
+
+    for(void* ptr : ptrs) {
+        EXPECT_TRUE(all_zero(ptr, 100 * 1024));
+        mem_free(ptr);
+    }
+    for(void* ptr : fillers) {
+        mem_free(ptr);
+    }
+    mem_configure(saved);
+}
+
+TEST(CallocTest, TrimmedPagesAreNotTouched) {
+    mem_config_t saved = mem_get_config();
+    mem_config_t config = saved;
+    config.trim_threshold = 0;
+    mem_configure(config);
+
+    // Dirty 10 MB of new heap, free it and give its pages back. The guard
+    // keeps it off the top, where trimming would move the break instead.
+    std::vector<void*> fillers = fill_until_growth(100 * 1024);
+    std::vector<void*> ptrs;
+    for(int i = 0; i < 100; i++) {
+        void* ptr = mem_alloc(100 * 1024);
+        ASSERT_NE(ptr, nullptr);
+        memset(ptr, 0xAB, 100 * 1024);
+        ptrs.push_back(ptr);
+    }
+    void* guard = mem_alloc(100 * 1024);
+    for(void* ptr : ptrs) {
+        mem_free(ptr);
+    }
+    mem_trim();
+
+    // The pages read zero without being cleared, so they stay unmapped
+    size_t rss_before = resident_bytes();
+    for(void*& ptr : ptrs) {
+        ptr = mem_calloc(100 * 1024, 1);
+        ASSERT_NE(ptr, nullptr);
+    }
+    EXPECT_LT(resident_bytes(), rss_before + 4 * 1024 * 1024);
+
+    for(void* ptr : ptrs) {
+        EXPECT_TRUE(all_zero(ptr, 100 * 1024));
+        mem_free(ptr);
+    }
+    mem_free(guard);
+    for(void* ptr : fillers) {
+        mem_free(ptr);
+    }
+    mem_configure(saved);
+}
+
+TEST(CallocTest, LargeComesFromMmap) {
+    size_t syscalls = mem_growth_syscalls();
+    void* ptr = mem_calloc(1024, 1024);
+    ASSERT_NE(ptr, nullptr);
+    EXPECT_EQ(mem_growth_syscalls(), syscalls + 1);
+    EXPECT_TRUE(all_zero(ptr, 1024 * 1024));
+    mem_free(ptr);
+}
+
+// ============================================================================
+// Realloc Tests
+// ============================================================================
+
+TEST(ReallocTest, NullAndZero) {
+    void* ptr = mem_realloc(nullptr, 100);
+    ASSERT_NE(ptr, nullptr);
+    EXPECT_GE(mem_usable_size(ptr), 100u);
+    EXPECT_EQ(mem_realloc(ptr, 0), nullptr);
+}
+
+TEST(ReallocTest, ShrinkSplitsInPlace) {
+    char* ptr = (char*)mem_alloc(8000);
+    ASSERT_NE(ptr, nullptr);
+    memset(ptr, 0x5A, 8000);
+
+    char* shrunk = (char*)mem_realloc(ptr, 2000);
+    EXPECT_EQ(shrunk, ptr);
+    EXPECT_LT(mem_usable_size(shrunk), 2100u);
+    for(int i = 0; i < 2000; i++) {
+        ASSERT_EQ(shrunk[i], 0x5A);
+    }
+
+    // the tail went back to the heap, growing again takes it back in place.
+    // Another request for its size could be served from an older free block.
+    char* grown = (char*)mem_realloc(shrunk, 8000);
+    EXPECT_EQ(grown, shrunk);
+    mem_free(grown);
+}
+
+TEST(ReallocTest, GrowAbsorbsFreeNeighbour) {
+    // Earlier tests leave free blocks around, take pairs until one lies
+    // back to back
+    std::vector<void*> spares;
+    char* ptr = nullptr;
+    char* next = nullptr;
+    for(int i = 0; i < 1000; i++) {
+        ptr = (char*)mem_alloc(3000);
+        next = (char*)mem_alloc(6000);
+        ASSERT_NE(ptr, nullptr);
+        ASSERT_NE(next, nullptr);
+        if(next == ptr + mem_usable_size(ptr) + 8) break;
+        spares.push_back(ptr);
+        spares.push_back(next);
+    }
+    ASSERT_EQ(next, ptr + mem_usable_size(ptr) + 8);
+    memset(ptr, 0x33, 3000);
+    mem_free(next);
+
+    char* grown = (char*)mem_realloc(ptr, 8000);
+    EXPECT_EQ(grown, ptr);
+    EXPECT_GE(mem_usable_size(grown), 8000u);
+    for(int i = 0; i < 3000; i++) {
+        ASSERT_EQ(grown[i], 0x33);
+    }
+    mem_free(grown);
+    for(void* spare : spares) {
+        mem_free(spare);
+    }
+}
+
+TEST(ReallocTest, MovesWhenNeighbourIsUsed) {
+    char* ptr = (char*)mem_alloc(3000);
+    void* next = mem_alloc(3000);
+    ASSERT_NE(ptr, nullptr);
+    ASSERT_NE(next, nullptr);
+    for(int i = 0; i < 3000; i++) ptr[i] = (char)i;
+
+    char* moved = (char*)mem_realloc(ptr, 50000);
+    ASSERT_NE(moved, nullptr);
+    for(int i = 0; i < 3000; i++) {
+        ASSERT_EQ(moved[i], (char)i);
+    }
+    mem_free(moved);
+    mem_free(next);
+}
+
+TEST(ReallocTest, GrowingBufferRarelyCopies) {
+    // a log buffer growing a little at a time mostly stays where it is. Only
+    // up to the mmap threshold, past it mremap moves the pages around freely.
+    size_t size = 2048;
+    char* buffer = (char*)mem_alloc(size);
+    ASSERT_NE(buffer, nullptr);
+    memset(buffer, 0x11, size);
+    int moves = 0;
+    while(size < MEM_DEFAULT_MMAP_THRESHOLD) {
+        size_t grown_size = size + size / 8;
+        char* grown = (char*)mem_realloc(buffer, grown_size);
+        ASSERT_NE(grown, nullptr);
+        if(grown != buffer) moves++;
+        ASSERT_EQ(grown[size - 1], 0x11);
+        memset(grown + size, 0x11, grown_size - size);
+        buffer = grown;
+        size = grown_size;
+    }
+    EXPECT_LT(moves, 10);
+    mem_free(buffer);
+}
+
+TEST(ReallocTest, MappedBlockKeepsContents) {
+    const size_t large_size = 1024 * 1024;
+    unsigned char* ptr = (unsigned char*)mem_alloc(large_size);
+    ASSERT_NE(ptr, nullptr);
+    for(size_t i = 0; i < large_size; i++) ptr[i] = (unsigned char)(i * 7);
+
+    size_t syscalls = mem_growth_syscalls();
+    ptr = (unsigned char*)mem_realloc(ptr, 16 * large_size);
+    ASSERT_NE(ptr, nullptr);
+    EXPECT_EQ(mem_growth_syscalls(), syscalls + 1);
+    for(size_t i = 0; i < large_size; i++) {
+        ASSERT_EQ(ptr[i], (unsigned char)(i * 7));
+    }
+
+    ptr = (unsigned char*)mem_realloc(ptr, large_size / 2);
+    ASSERT_NE(ptr, nullptr);
+    EXPECT_LT(mem_usable_size(ptr), large_size);
+    EXPECT_EQ(ptr[large_size / 2 - 1], (unsigned char)((large_size / 2 - 1) * 7));
+    mem_free(ptr);
+}
+
+TEST(ReallocTest, SmallBlocksResize) {
+    char* ptr = (char*)mem_alloc(10);
+    ASSERT_NE(ptr, nullptr);
+    memcpy(ptr, "memcpp", 7);
+    for(size_t size = 20; size <= 4000; size += 100) {
+        ptr = (char*)mem_realloc(ptr, size);
+        ASSERT_NE(ptr, nullptr);
+        ASSERT_STREQ(ptr, "memcpp");
+    }
+    for(size_t size = 4000; size >= 10; size /= 2) {
+        ptr = (char*)mem_realloc(ptr, size);
+        ASSERT_NE(ptr, nullptr);
+        ASSERT_STREQ(ptr, "memcpp");
+    }
+    mem_free(ptr);
+}
+
+// ============================================================================
+// Batch Tests
+// ============================================================================
+
+TEST(BatchTest, CarvesOneContiguousRun) {
+    std::vector<void*> ptrs(1000);
+    ASSERT_EQ(mem_alloc_batch(200, ptrs.size(), ptrs.data()), ptrs.size());
+    for(size_t i = 1; i < ptrs.size(); i++) {
+        ASSERT_EQ((char*)ptrs[i] - (char*)ptrs[i - 1], 208);
+    }
+    for(void* ptr : ptrs) {
+        memset(ptr, 0x6B, 200);
+    }
+    mem_free_batch(ptrs.data(), ptrs.size());
+}
+
+TEST(BatchTest, FreedNeighboursCoalesce) {
+    // keep the free run in the heap instead of trimming it
+    mem_config_t saved = mem_get_config();
+    mem_config_t config = saved;
+    config.trim_threshold = 0;
+    mem_configure(config);
+
+    std::vector<void*> ptrs(64);
+    ASSERT_EQ(mem_alloc_batch(3000, ptrs.size(), ptrs.data()), ptrs.size());
+    std::reverse(ptrs.begin(), ptrs.end());
+    mem_free_batch(ptrs.data(), ptrs.size());
+
+    EXPECT_GE(mem_stats().largest_free_block, 64 * 3000u);
+    mem_configure(saved);
+}
+
+TEST(BatchTest, MixedSizesAndEntries) {
+    void* small[16];
+    void* large[3];
+    ASSERT_EQ(mem_alloc_batch(24, 16, small), 16u);
+    ASSERT_EQ(mem_alloc_batch(512 * 1024, 3, large), 3u);
+    EXPECT_EQ(mem_alloc_batch(100, 0, small), 0u);
+
+    // blocks from a batch can be freed one by one
+    mem_free(small[0]);
+    small[0] = nullptr;
+    memset(large[1], 0x3C, 512 * 1024);
+
+    void* rest[] = {small[1], nullptr, large[0], large[1], large[2], small[1]};
+    mem_free_batch(rest, 6);
+    mem_free_batch(small + 2, 14);
+}
+
+TEST(BatchTest, CountsInStats) {
+    mem_stats_t before = mem_stats();
+    void* ptrs[100];
+    ASSERT_EQ(mem_alloc_batch(200, 100, ptrs), 100u);
+    EXPECT_EQ(mem_stats().allocations, before.allocations + 100);
+    mem_free_batch(ptrs, 100);
+
+    mem_stats_t after = mem_stats();
+    EXPECT_EQ(after.frees, before.frees + 100);
+    EXPECT_EQ(after.bytes_in_use, before.bytes_in_use);
+}
+
+// ============================================================================
+// Block Header Tests
+// ============================================================================
+
+TEST(HeaderTest, UsableSizeCoversRequest) {
+    for(size_t size : {1, 16, 24, 100, 1000, 5000, 300000}) {
+        void* ptr = mem_alloc(size);
+        ASSERT_NE(ptr, nullptr);
+        EXPECT_GE(mem_usable_size(ptr), size);
+        memset(ptr, 0x6B, mem_usable_size(ptr));
+        mem_free(ptr);
+    }
+}
+
+TEST(HeaderTest, OverheadPerSmallAllocation) {
+    // Bytes of heap consumed per object beyond the request itself, just
+    // past the sizes served from slabs. Earlier tests may leave free blocks a
+    // granule larger than the request, measure the spacing of two equal
+    // neighbours a refill carves instead.
+    for(size_t size = SLAB_MAX_SIZE + 8; size <= SLAB_MAX_SIZE + 40; size += 8) {
+        std::vector<void*> ptrs = {mem_alloc(size)};
+        size_t spacing = 0;
+        while(spacing == 0 && ptrs.size() < 4096) {
+            ptrs.push_back(mem_alloc(size));
+            ASSERT_NE(ptrs.back(), nullptr);
+            char* last = (char*)ptrs.back();
+            char* prev = (char*)ptrs[ptrs.size() - 2];
+            char* lower = last < prev ? last : prev;
+            char* upper = last < prev ? prev : last;
+            if(mem_usable_size(lower) == mem_usable_size(upper) &&
+               upper == lower + mem_usable_size(lower) + sizeof(size_t)) {
+                spacing = upper - lower;
+            }
+        }
+        ASSERT_NE(spacing, 0u);
+
+        // One 8 byte header plus at most one granule of rounding
+        EXPECT_LT(spacing - size, sizeof(size_t) + 16);
+        for(void* ptr : ptrs) {
+            mem_free(ptr);
+        }
+    }
+}
+
+TEST(HeaderTest, AdjacentObjectsArePacked) {
+    // 136 byte objects carved next to each other sit 144 bytes apart. Earlier
+    // tests may leave scattered free blocks of this size, keep allocating
+    // until those run out and a refill carves fresh neighbours.
+    std::vector<void*> ptrs = {mem_alloc(136)};
+    bool packed = false;
+    while(!packed && ptrs.size() < 4096) {
+        ptrs.push_back(mem_alloc(136));
+        intptr_t distance = (char*)ptrs.back() - (char*)ptrs[ptrs.size() - 2];
+        packed = distance == 144 || distance == -144;
+    }
+    EXPECT_TRUE(packed);
+    for(void* ptr : ptrs) {
+        mem_free(ptr);
+    }
+}
+
+// ============================================================================
+// Slab Tests
+// ============================================================================
+
+TEST(SlabTest, SmallObjectsHaveNoHeader) {
+    // A batch comes from one slab, objects sit next to each other at their size
+    for(size_t size : {8, 16, 24, 40, 64, 128}) {
+        void* ptrs[32];
+        ASSERT_EQ(mem_alloc_batch(size, 32, ptrs), 32u);
+        int packed = 0;
+        for(int i = 0; i < 32; i++) {
+            EXPECT_EQ(mem_usable_size(ptrs[i]), size);
+            memset(ptrs[i], 0x5C, size);
+            intptr_t distance = i > 0 ? (char*)ptrs[i] - (char*)ptrs[i - 1] : 0;
+            if(distance == (intptr_t)size || distance == -(intptr_t)size) packed++;
+        }
+        EXPECT_GT(packed, 16) << size << " byte objects";
+        mem_free_batch(ptrs, 32);
+    }
+}
+
+TEST(SlabTest, SizesRoundUpToEightBytes) {
+    for(size_t size = 1; size <= SLAB_MAX_SIZE; size++) {
+        void* ptr = mem_alloc(size);
+        ASSERT_NE(ptr, nullptr);
+        size_t usable = mem_usable_size(ptr);
+        EXPECT_GE(usable, size);
+        EXPECT_LT(usable, size + 8);
+        EXPECT_TRUE(is_aligned(ptr, usable % 16 == 0 ? 16 : 8));
+        mem_free(ptr);
+    }
+    // The next size up goes to the heap, header and all. A free block left
+    // by an earlier test may be a granule larger, the smallest of those taken
+    // until the heap grows was carved from new memory.
+    std::vector<void*> fillers = fill_until_growth(SLAB_MAX_SIZE + 1);
+    size_t smallest = SIZE_MAX;
+    for(void* ptr : fillers) {
+        size_t usable = mem_usable_size(ptr);
+        EXPECT_GE(usable, SLAB_MAX_SIZE + 8);
+        if(usable < smallest) smallest = usable;
+        mem_free(ptr);
+    }
+    EXPECT_EQ(smallest, SLAB_MAX_SIZE + 8);
+}
+
+TEST(SlabTest, AlignedRequestsUseSlabs) {
+    for(size_t alignment = 1; alignment <= SLAB_MAX_SIZE; alignment <<= 1) {
+        for(size_t size : {1, 8, 24, 72}) {
+            void* ptr = mem_alloc_align(size, static_cast<Alignment>(alignment));
+            ASSERT_NE(ptr, nullptr);
+            EXPECT_TRUE(is_aligned(ptr, alignment)) << size << " bytes at " << alignment;
+            EXPECT_GE(mem_usable_size(ptr), size);
+            mem_free(ptr);
+        }
+    }
+}
+
+TEST(SlabTest, DensityOfSmallObjects) {
+    // 100000 16 byte objects take little more than 1.6 MB of slabs
+    const size_t count = 100000;
+    mem_stats_t before = mem_stats();
+    std::vector<void*> ptrs(count);
+    for(size_t i = 0; i < count; i++) {
+        ptrs[i] = mem_alloc(16);
+        ASSERT_NE(ptrs[i], nullptr);
+    }
+    size_t grown = mem_stats().slab_bytes - before.slab_bytes;
+    EXPECT_LT(grown, count * 16 * 11 / 10);
+    for(void* ptr : ptrs) {
+        mem_free(ptr);
+    }
+}
+
+TEST(SlabTest, EmptySlabsAreReleased) {
+    std::vector<void*> ptrs(100000);
+    for(void*& ptr : ptrs) {
+        ptr = mem_alloc(40);
+    }
+    mem_free_batch(ptrs.data(), ptrs.size());
+    mem_trim();
+
+    mem_stats_t stats = mem_stats();
+    EXPECT_LT(stats.slab_bytes, 100000 * 40 / 4);
+
+    // Released slabs are used again
+    for(void*& ptr : ptrs) {
+        ptr = mem_alloc(40);
+        memset(ptr, 0x2E, 40);
+    }
+    mem_free_batch(ptrs.data(), ptrs.size());
+}
+
+TEST(SlabTest, DoubleFreeIsIgnored) {
+    void* ptrs[4];
+    ASSERT_EQ(mem_alloc_batch(32, 4, ptrs), 4u);
+    void* twice[] = {ptrs[0], ptrs[1], ptrs[0], ptrs[2], ptrs[3], ptrs[1]};
+    mem_free_batch(twice, 6);
+
+    // Every object comes back once
+    void* again[8];
+    ASSERT_EQ(mem_alloc_batch(32, 8, again), 8u);
+    std::sort(again, again + 8);
+    EXPECT_EQ(std::adjacent_find(again, again + 8), again + 8);
+    mem_free_batch(again, 8);
+}
+
+TEST(SlabTest, ReallocAcrossClasses) {
+    char* ptr = (char*)mem_alloc(20);
+    memcpy(ptr, "slab object", 12);
+    EXPECT_EQ(mem_realloc(ptr, 24), ptr);
+
+    for(size_t size : {100, 4000, 9, 130, 12}) {
+        ptr = (char*)mem_realloc(ptr, size);
+        ASSERT_NE(ptr, nullptr);
+        ASSERT_STREQ(ptr, "slab object");
+    }
+    mem_free(ptr);
+}
+
+TEST(SlabTest, HeapsRefillFromTheirOwnSlabs) {
+    mem_config_t saved = mem_get_config();
+    mem_config_t config = saved;
+    config.heap_count = 2;
+    config.heap_select = HEAP_SELECT_THREAD;
+    mem_configure(config);
+
+    // Threads on different heaps take different locks, and never share a slab
+    void* first[16];
+    void* second[16];
+    std::thread([&first]() { ASSERT_EQ(mem_alloc_batch(48, 16, first), 16u); }).join();
+    std::thread([&second]() { ASSERT_EQ(mem_alloc_batch(48, 16, second), 16u); }).join();
+    auto slab_index = [](void* ptr) {
+        return ((uintptr_t)ptr - slab_base.load()) >> SLAB_SHIFT;
+    };
+    for(int i = 0; i < 16; i++) {
+        EXPECT_NE(slab_index(first[i]), slab_index(second[0]));
+        EXPECT_NE(slab_index(second[i]), slab_index(first[0]));
+    }
+
+    // Freed from a third thread, the objects go back to their own slabs,
+    // where the next refill of either heap finds them
+    std::thread([&first, &second]() {
+        mem_free_batch(first, 16);
+        mem_free_batch(second, 16);
+    }).join();
+    void* again[16];
+    std::thread([&again]() { ASSERT_EQ(mem_alloc_batch(48, 16, again), 16u); }).join();
+    size_t slab = slab_index(again[0]);
+    EXPECT_TRUE(slab == slab_index(first[0]) || slab == slab_index(second[0]));
+    mem_free_batch(again, 16);
+
+    mem_configure(saved);
+}
+
+// ============================================================================
+// Sized Free Tests
+// ============================================================================
+
+TEST(SizedFreeTest, EverySizeAndKind) {
+    mem_stats_t before = mem_stats();
+    for(size_t size : {1, 8, 24, 100, 128, 129, 1000, 5000, 300000}) {
+        void* ptr = mem_alloc(size);
+        ASSERT_NE(ptr, nullptr);
+        memset(ptr, 0x4D, size);
+        mem_free_sized(ptr, size);
+    }
+    mem_free_sized(nullptr, 16);
+
+    mem_stats_t after = mem_stats();
+    EXPECT_EQ(after.frees, before.frees + 9);
+    EXPECT_EQ(after.bytes_in_use, before.bytes_in_use);
+}
+
+TEST(SizedFreeTest, GoesToTheSameClass) {
+    void* ptr1 = mem_alloc(64);
+    mem_free_sized(ptr1, 64);
+    void* ptr2 = mem_alloc(60);
+    EXPECT_EQ(ptr1, ptr2);
+
+    // any size up to the usable size names the same object
+    mem_free_sized(ptr2, 57);
+    EXPECT_EQ(mem_alloc(64), ptr1);
+    mem_free(ptr1);
+}
+
+TEST(SizedFreeTest, AlignedSizes) {
+    for(size_t alignment = 8; alignment <= 4096; alignment <<= 1) {
+        for(size_t size : {1, 40, 100, 3000}) {
+            Alignment a = static_cast<Alignment>(alignment);
+            void* ptr = mem_alloc_align(size, a);
+            ASSERT_NE(ptr, nullptr);
+            mem_free_aligned_sized(ptr, size, a);
+
+            // freed into the bin the next aligned request looks in
+            void* again = mem_alloc_align(size, a);
+            EXPECT_TRUE(is_aligned(again, alignment));
+            mem_free_aligned_sized(again, size, a);
+        }
+    }
+}
+
+TEST(SizedFreeTest, MismatchIsCaughtInDebugBuilds) {
+    void* ptr = mem_alloc(64);
+    // a release build takes the object into a smaller class, which is safe
+    EXPECT_DEBUG_DEATH(mem_free_sized(ptr, 8), "size does not match");
+
+    void* large = mem_alloc(2000);
+    EXPECT_DEBUG_DEATH(mem_free_sized(large, 4000), "size does not match");
+#ifndef NDEBUG
+    // the death tests ran in a child, both are still live here
+    mem_free(ptr);
+    mem_free(large);
+#endif
+}
+
+// ============================================================================
+// Thread Cache Tests
+// ============================================================================
+
+TEST(ThreadCacheTest, ReusesLastFreedBlock) {
+    // Same size class, served from this thread's cache. A block refilled from
+    // a slightly larger free block is freed into the next size's bin, retry
+    // until one of this size comes back.
+    bool reused = false;
+    for(int i = 0; i < 64 && !reused; i++) {
+        void* ptr1 = mem_alloc(64);
+        ASSERT_NE(ptr1, nullptr);
+        mem_free(ptr1);
+
+        void* ptr2 = mem_alloc(60);
+        reused = ptr1 == ptr2;
+        mem_free(ptr2);
+    }
+    EXPECT_TRUE(reused);
+}
+
+TEST(ThreadCacheTest, OverflowFlushesToHeap) {
+    // More frees than a single bin can hold
+    const int count = 1000;
+    std::vector<void*> ptrs;
+    for(int i = 0; i < count; i++) {
+        ptrs.push_back(mem_alloc(32));
+        ASSERT_NE(ptrs.back(), nullptr);
+        memset(ptrs.back(), i & 0xFF, 32);
+    }
+    for(void* ptr : ptrs) {
+        mem_free(ptr);
+    }
+
+    // Blocks given back to the heap must still be usable
+    void* large = mem_alloc(4096);
+    ASSERT_NE(large, nullptr);
+    memset(large, 0x11, 4096);
+    mem_free(large);
+}
+
+TEST(ThreadCacheTest, CrossThreadFree) {
+    const int count = 500;
+    std::vector<void*> ptrs(count);
+    std::thread producer([&]() {
+        for(int i = 0; i < count; i++) {
+            ptrs[i] = mem_alloc(16 + (i % 8) * 16);
+            memset(ptrs[i], 0x5A, 16);
+        }
+    });
+    producer.join();
+
+    std::thread consumer([&]() {
+        for(void* ptr : ptrs) {
+            mem_free(ptr);
+        }
+    });
+    consumer.join();
+
+    void* ptr = mem_alloc(64);
+    EXPECT_NE(ptr, nullptr);
+    mem_free(ptr);
+}
+
+TEST(ThreadCacheTest, ThreadsHitTheirOwnCache) {
+    // Every thread gets back the block it just freed, whatever the others do
+    // meanwhile. A shared free list would hand it to whichever thread asked first.
+    // The first pass over the sizes fills the caches and is not counted: a
+    // block refilled from a slightly larger free block is freed into the next
+    // size's bin.
+    const int num_threads = 8, rounds = 20000;
+    std::vector<int> misses(num_threads, 0);
+    std::vector<std::thread> threads;
+    for(int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&misses, t]() {
+            for(int i = 0; i < rounds; i++) {
+                size_t size = 16 + (i % 8) * 16;
+                void* ptr = mem_alloc(size);
+                mem_free(ptr);
+                void* again = mem_alloc(size);
+                if(again != ptr && i >= 8) misses[t]++;
+                mem_free(again);
+            }
+        });
+    }
+    for(auto& t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(misses, std::vector<int>(num_threads, 0));
+}
+
+// ============================================================================
+// Sharded Heap Tests
+// ============================================================================
+
+TEST(HeapTest, HeapCountIsClamped) {
+    mem_config_t saved = mem_get_config();
+    EXPECT_GE(saved.heap_count, 1u);
+    EXPECT_LE(saved.heap_count, (size_t)MEM_MAX_HEAPS);
+
+    mem_config_t config = saved;
+    config.heap_count = 1000;
+    mem_configure(config);
+    EXPECT_EQ(mem_get_config().heap_count, (size_t)MEM_MAX_HEAPS);
+
+    // 0 picks one heap per CPU
+    config.heap_count = 0;
+    mem_configure(config);
+    size_t cpus = (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+    EXPECT_EQ(mem_get_config().heap_count, cpus < MEM_MAX_HEAPS ? cpus : MEM_MAX_HEAPS);
+
+    mem_configure(saved);
+}
+
+TEST(HeapTest, RemoteFreeReturnsToOwningHeap) {
+    mem_config_t saved = mem_get_config();
+    mem_config_t config = saved;
+    config.heap_count = 4;
+    config.heap_select = HEAP_SELECT_THREAD;
+    mem_configure(config);
+
+    // Threads get consecutive heaps, the freeing thread lands on another one
+    std::thread owner([]() {
+        void* guard1 = mem_alloc(4000);
+        void* ptr = mem_alloc(4000);
+        void* guard2 = mem_alloc(4000);
+        ASSERT_NE(ptr, nullptr);
+
+        std::thread other([ptr]() { mem_free(ptr); });
+        other.join();
+
+        // The block went back to the owner's heap, not the freeing thread's
+        void* again = mem_alloc(4000);
+        EXPECT_EQ(again, ptr);
+        mem_free(again);
+        mem_free(guard1);
+        mem_free(guard2);
+    });
+    owner.join();
+
+    mem_configure(saved);
+}
+
+TEST(HeapTest, ConcurrentHandOff) {
+    mem_config_t saved = mem_get_config();
+    mem_config_t config = saved;
+    config.heap_count = 8;
+    config.heap_select = HEAP_SELECT_THREAD;
+    mem_configure(config);
+
+    // Every thread frees the blocks its neighbour allocated
+    const int num_threads = 8;
+    const int count = 2000;
+    std::vector<std::vector<void*>> blocks(num_threads, std::vector<void*>(count));
+    std::vector<std::thread> threads;
+    for(int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&blocks, t]() {
+            for(int i = 0; i < count; i++) {
+                size_t size = 1024 + (size_t)((i * 7919 + t) % 16) * 512;
+                blocks[t][i] = mem_alloc(size);
+                ASSERT_NE(blocks[t][i], nullptr);
+                memset(blocks[t][i], t, size);
+            }
+        });
+    }
+    for(auto& thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+
+    for(int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&blocks, t]() {
+            std::vector<void*>& theirs = blocks[(t + 1) % num_threads];
+            for(int i = 0; i < count; i++) {
+                EXPECT_EQ(*(unsigned char*)theirs[i], (t + 1) % num_threads);
+                mem_free(theirs[i]);
+            }
+        });
+    }
+    for(auto& thread : threads) {
+        thread.join();
+    }
+
+    mem_configure(saved);
+}
+
+TEST(HeapTest, RemoteFreesAreReusedByOwner) {
+    mem_config_t saved = mem_get_config();
+    mem_config_t config = saved;
+    config.heap_count = 4;
+    config.heap_select = HEAP_SELECT_THREAD;
+    config.trim_threshold = 0;
+    mem_configure(config);
+
+    std::thread owner([]() {
+        const int count = 256;
+        std::vector<void*> ptrs(count);
+        size_t syscalls = 0;
+        for(int round = 0; round < 32; round++) {
+            for(int i = 0; i < count; i++) {
+                ptrs[i] = mem_alloc(4096);
+                ASSERT_NE(ptrs[i], nullptr);
+                memset(ptrs[i], round, 4096);
+            }
+            // Later rounds must get the memory back without growing the heap
+            if(round == 0) {
+                syscalls = mem_growth_syscalls();
+            }
+
+            std::thread consumer([&ptrs]() {
+                for(void* ptr : ptrs) {
+                    mem_free(ptr);
+                }
+            });
+            consumer.join();
+        }
+        EXPECT_EQ(mem_growth_syscalls(), syscalls);
+    });
+    owner.join();
+
+    mem_configure(saved);
+}
+
+TEST(HeapTest, RemoteFreesDrainWithoutTheOwner) {
+    mem_config_t saved = mem_get_config();
+    mem_config_t config = saved;
+    config.heap_count = 4;
+    config.heap_select = HEAP_SELECT_THREAD;
+    config.trim_threshold = 0;
+    mem_configure(config);
+
+    // The owner exits and never allocates again to drain its heap
+    const int count = 256;
+    std::vector<void*> ptrs(count);
+    std::thread owner([&ptrs]() {
+        for(void* &ptr : ptrs) {
+            ptr = mem_alloc(4096);
+        }
+    });
+    owner.join();
+    std::thread freer([&ptrs]() {
+        for(void* ptr : ptrs) {
+            mem_free(ptr);
+        }
+    });
+    freer.join();
+
+    // Only the last few frees may still wait on the remote list
+    int drained = 0;
+    for(void* ptr : ptrs) {
+        if(block_is_free(block_of(ptr))) drained++;
+    }
+    EXPECT_GT(drained, count / 2);
+
+    mem_configure(saved);
+}
@@ -0,0 +1,95 @@
+#include <gtest/gtest.h>
+#include "../include/allocator.hpp"
+#include <cstdint>
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// ============================================================================
+// STL Allocator Tests
+// ============================================================================
+
+TEST(AllocatorTest, Vector) {
+    std::vector<int, memcpp::allocator<int>> values;
+    for(int i = 0; i < 100000; i++) {
+        values.push_back(i);
+    }
+    for(int i = 0; i < 100000; i++) {
+        EXPECT_EQ(values[i], i);
+    }
+}
+
+TEST(AllocatorTest, UnorderedMap) {
+    using map_allocator = memcpp::allocator<std::pair<const int, int>>;
+    std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, map_allocator> squares;
+    for(int i = 0; i < 10000; i++) {
+        squares[i] = i * i;
+    }
+    EXPECT_EQ(squares.size(), 10000u);
+    for(int i = 0; i < 10000; i++) {
+        EXPECT_EQ(squares[i], i * i);
+    }
+}
+
+TEST(AllocatorTest, String) {
+    using mem_string = std::basic_string<char, std::char_traits<char>, memcpp::allocator<char>>;
+    mem_string text;
+    for(int i = 0; i < 1000; i++) {
+        text += "memcpp ";
+    }
+    EXPECT_EQ(text.size(), 7000u);
+    EXPECT_EQ(text.substr(0, 7), "memcpp ");
+}
+
+TEST(AllocatorTest, OverAlignedType) {
+    struct alignas(64) Padded {
+        uint64_t value;
+    };
+    std::vector<Padded, memcpp::allocator<Padded>> values(10);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(values.data()) % 64, 0u);
+}
+
+TEST(AllocatorTest, RebindAndCompare) {
+    memcpp::allocator<int> ints;
+    memcpp::allocator<double> doubles(ints);
+    EXPECT_TRUE(ints == doubles);
+    EXPECT_FALSE(ints != doubles);
+}
+
+// ============================================================================
+// Memory Resource Tests
+// ============================================================================
+
+TEST(MemoryResourceTest, PmrContainers) {
+    std::pmr::memory_resource* resource = memcpp::get_memory_resource();
+
+    std::pmr::vector<std::pmr::string> words(resource);
+    for(int i = 0; i < 1000; i++) {
+        words.emplace_back("a string long enough to skip the small buffer " + std::to_string(i));
+    }
+    std::pmr::map<int, int> ordered(resource);
+    for(int i = 0; i < 1000; i++) {
+        ordered[i] = -i;
+    }
+
+    EXPECT_EQ(words.size(), 1000u);
+    EXPECT_EQ(words[999].get_allocator().resource(), resource);
+    EXPECT_EQ(ordered[500], -500);
+}
+
+TEST(MemoryResourceTest, HonoursAlignment) {
+    std::pmr::memory_resource* resource = memcpp::get_memory_resource();
+    for(size_t alignment : {8, 16, 64, 4096}) {
+        void* ptr = resource->allocate(100, alignment);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % alignment, 0u);
+        resource->deallocate(ptr, 100, alignment);
+    }
+}
+
+TEST(MemoryResourceTest, Equality) {
+    memcpp::memory_resource other;
+    EXPECT_TRUE(memcpp::get_memory_resource()->is_equal(other));
+    EXPECT_FALSE(memcpp::get_memory_resource()->is_equal(*std::pmr::new_delete_resource()));
+}
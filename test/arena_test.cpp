@@ -0,0 +1,110 @@
+#include <gtest/gtest.h>
+#include "../include/arena.hpp"
+#include <cstring>
+#include <cstdint>
+#include <vector>
+
+static bool is_aligned(void* ptr, size_t alignment) {
+    return (reinterpret_cast<uintptr_t>(ptr) % alignment) == 0;
+}
+
+// ============================================================================
+// Arena Tests
+// ============================================================================
+
+TEST(ArenaTest, BumpAllocation) {
+    mem_arena_t* arena = mem_arena_create();
+    ASSERT_NE(arena, nullptr);
+
+    void* ptr1 = mem_arena_alloc(arena, 32);
+    void* ptr2 = mem_arena_alloc(arena, 32);
+    ASSERT_NE(ptr1, nullptr);
+    ASSERT_NE(ptr2, nullptr);
+
+    // Consecutive allocations sit right next to each other
+    EXPECT_EQ(static_cast<char*>(ptr2) - static_cast<char*>(ptr1), 32);
+    EXPECT_TRUE(is_aligned(ptr1, ALIGN_NATURAL));
+
+    mem_arena_destroy(arena);
+}
+
+TEST(ArenaTest, AlignedAllocation) {
+    mem_arena_t* arena = mem_arena_create();
+    ASSERT_NE(arena, nullptr);
+
+    Alignment alignments[] = {ALIGN_1, ALIGN_8, ALIGN_64, ALIGN_4096};
+    for(Alignment alignment : alignments) {
+        mem_arena_alloc(arena, 3); // knock the cursor off alignment
+        void* ptr = mem_arena_alloc_align(arena, 100, alignment);
+        ASSERT_NE(ptr, nullptr);
+        EXPECT_TRUE(is_aligned(ptr, alignment));
+        memset(ptr, 0x4D, 100);
+    }
+
+    mem_arena_destroy(arena);
+}
+
+TEST(ArenaTest, SpillsIntoNewChunks) {
+    mem_arena_t* arena = mem_arena_create(1024);
+    ASSERT_NE(arena, nullptr);
+
+    // Far more than one chunk, plus a request bigger than any chunk
+    std::vector<unsigned char*> ptrs;
+    for(int i = 0; i < 200; i++) {
+        unsigned char* ptr = static_cast<unsigned char*>(mem_arena_alloc(arena, 100));
+        ASSERT_NE(ptr, nullptr);
+        memset(ptr, i, 100);
+        ptrs.push_back(ptr);
+    }
+    void* big = mem_arena_alloc(arena, 10000);
+    ASSERT_NE(big, nullptr);
+    memset(big, 0xEE, 10000);
+
+    for(int i = 0; i < 200; i++) {
+        EXPECT_EQ(ptrs[i][0], static_cast<unsigned char>(i));
+        EXPECT_EQ(ptrs[i][99], static_cast<unsigned char>(i));
+    }
+
+    mem_arena_destroy(arena);
+}
+
+TEST(ArenaTest, ImpossibleSizesFail) {
+    mem_arena_t* arena = mem_arena_create();
+    ASSERT_NE(arena, nullptr);
+
+    // Sizes whose chunk would wrap around the address space
+    EXPECT_EQ(mem_arena_alloc(arena, SIZE_MAX), nullptr);
+    EXPECT_EQ(mem_arena_alloc(arena, SIZE_MAX - 8), nullptr);
+    EXPECT_EQ(mem_arena_alloc_align(arena, SIZE_MAX - 100, ALIGN_4096), nullptr);
+    EXPECT_EQ(mem_arena_alloc(arena, SIZE_MAX / 2), nullptr);
+
+    // The arena is still usable afterwards
+    void* ptr = mem_arena_alloc(arena, 32);
+    ASSERT_NE(ptr, nullptr);
+    memset(ptr, 0x5C, 32);
+
+    mem_arena_destroy(arena);
+}
+
+TEST(ArenaTest, ResetReusesMemory) {
+    mem_arena_t* arena = mem_arena_create(4096);
+    ASSERT_NE(arena, nullptr);
+
+    std::vector<void*> first_round;
+    for(int i = 0; i < 100; i++) {
+        first_round.push_back(mem_arena_alloc(arena, 200));
+    }
+
+    mem_arena_reset(arena);
+
+    // Same request sequence lands on the same addresses
+    for(int i = 0; i < 100; i++) {
+        EXPECT_EQ(mem_arena_alloc(arena, 200), first_round[i]);
+    }
+
+    mem_arena_destroy(arena);
+}
+
+TEST(ArenaTest, DestroyNull) {
+    EXPECT_NO_THROW(mem_arena_destroy(nullptr));
+}
@@ -1,161 +1,1018 @@
+// memcpp_bench: memcpp against malloc and new/delete.
+//
+//   memcpp_bench [--format csv|json] [--suite NAME]... [--ops N] [--seed N]
+//                [--trace FILE]
+//
+// Every case runs in a forked child, so it starts from a fresh heap and its
+// peak RSS can be read back with wait4. Each workload gets a warm-up pass,
+// then an untimed-per-call pass for throughput and a pass timing every call
+// for the latency percentiles. The cost of reading the clock is measured once
+// and subtracted from each sample. Cases that count cycles per call read the
+// time stamp counter, so the column stays empty on other targets.
 #include "../include/alignment.hpp"
 #include "../include/alloc.hpp"
+#include "../include/allocator.hpp"
+#include "../include/inline_alloc.hpp"
+#include "../include/object_pool.hpp"
+#include "../include/stats.hpp"
+#include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <random>
 #include <chrono>
+#include <cmath>
 #include <cstddef>
-#include <cstdlib> // for std::getenv
-#include <filesystem>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <functional>
 #include <iostream>
-#include <matplot/matplot.h>
-#include <sstream>
+#include <new>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <memory_resource>
 #include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
-void successive_allocations(bool with_free = true) {
-  size_t alloc_size = 64;
-  size_t n_runs = 5000;
+// ============================================================================
+// Harness
+// ============================================================================
 
-  std::vector<std::chrono::microseconds> memcpp_results;
-  std::vector<std::chrono::microseconds> malloc_results;
-  std::vector<std::chrono::microseconds> new_delete_results;
+struct bench_options {
+  bool json = false;
+  std::vector<std::string> suites;
+  size_t ops = 200000;
+  uint64_t seed = 42;
+  std::vector<size_t> trace_sizes;
+};
 
-  // Helper to get home directory
-  auto get_home_dir = []() -> std::string {
-    const char *home = std::getenv("HOME");
-    if (home)
-      return std::string(home);
-    return "."; // fallback
+static bench_options options;
+static uint64_t timer_overhead = 0;
+
+// What a child sends back to the parent, plain data only.
+struct bench_metrics {
+  size_t ops = 0;
+  double seconds = 0;
+  bool has_latency = false;
+  double p50_ns = 0, p99_ns = 0, p999_ns = 0;
+  double cycles_per_op = 0; // 0 when not measured
+  bool has_fragmentation = false;
+  double fragmentation = 0; // mem_stats at the end of the case
+};
+
+struct bench_row {
+  std::string suite, name, allocator;
+  int threads = 1;
+  size_t alignment = 0;
+  bench_metrics metrics = {};
+  long peak_rss_kb = 0;
+};
+
+static std::vector<bench_row> json_rows;
+
+static inline uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// reference cycles, 0 where there is no time stamp counter
+static inline uint64_t now_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// cheapest back to back clock read, taken off every latency sample
+static uint64_t measure_timer_overhead() {
+  uint64_t best = UINT64_MAX;
+  for (int i = 0; i < 10000; ++i) {
+    uint64_t start = now_ns();
+    uint64_t end = now_ns();
+    best = std::min(best, end - start);
+  }
+  return best;
+}
+
+struct latency_samples {
+  std::vector<uint32_t> ns;
+
+  void add(uint64_t start, uint64_t end) {
+    uint64_t elapsed = end - start;
+    elapsed = elapsed > timer_overhead ? elapsed - timer_overhead : 0;
+    ns.push_back((uint32_t)std::min<uint64_t>(elapsed, UINT32_MAX));
+  }
+
+  void summarize(bench_metrics &metrics) {
+    if (ns.empty()) return;
+    std::sort(ns.begin(), ns.end());
+    auto at = [&](double q) { return (double)ns[std::min(ns.size() - 1, (size_t)(ns.size() * q))]; };
+    metrics.has_latency = true;
+    metrics.p50_ns = at(0.5);
+    metrics.p99_ns = at(0.99);
+    metrics.p999_ns = at(0.999);
+  }
+};
+
+static void print_csv_header() {
+  std::cout << "suite,case,allocator,threads,alignment,ops,ops_per_s,p50_ns,p99_ns,p999_ns,cycles_per_op,fragmentation,peak_rss_kb\n";
+}
+
+static void print_csv(const bench_row &row) {
+  const bench_metrics &m = row.metrics;
+  std::cout << row.suite << "," << row.name << "," << row.allocator << "," << row.threads << ","
+            << row.alignment << "," << m.ops << "," << (uint64_t)(m.ops / m.seconds) << ",";
+  if (m.has_latency) {
+    std::cout << m.p50_ns << "," << m.p99_ns << "," << m.p999_ns;
+  } else {
+    std::cout << ",,";
+  }
+  std::cout << ",";
+  if (m.cycles_per_op > 0) {
+    std::cout << m.cycles_per_op;
+  }
+  std::cout << ",";
+  if (m.has_fragmentation) {
+    std::cout << m.fragmentation;
+  }
+  std::cout << "," << row.peak_rss_kb << "\n";
+  std::cout.flush();
+}
+
+static void print_json() {
+  std::cout << "[\n";
+  for (size_t i = 0; i < json_rows.size(); ++i) {
+    const bench_row &row = json_rows[i];
+    const bench_metrics &m = row.metrics;
+    std::cout << "  {\"suite\": \"" << row.suite << "\", \"case\": \"" << row.name
+              << "\", \"allocator\": \"" << row.allocator << "\", \"threads\": " << row.threads
+              << ", \"alignment\": " << row.alignment << ", \"ops\": " << m.ops
+              << ", \"ops_per_s\": " << (uint64_t)(m.ops / m.seconds);
+    if (m.has_latency) {
+      std::cout << ", \"p50_ns\": " << m.p50_ns << ", \"p99_ns\": " << m.p99_ns
+                << ", \"p999_ns\": " << m.p999_ns;
+    } else {
+      std::cout << ", \"p50_ns\": null, \"p99_ns\": null, \"p999_ns\": null";
+    }
+    if (m.cycles_per_op > 0) {
+      std::cout << ", \"cycles_per_op\": " << m.cycles_per_op;
+    } else {
+      std::cout << ", \"cycles_per_op\": null";
+    }
+    if (m.has_fragmentation) {
+      std::cout << ", \"fragmentation\": " << m.fragmentation;
+    } else {
+      std::cout << ", \"fragmentation\": null";
+    }
+    std::cout << ", \"peak_rss_kb\": " << row.peak_rss_kb << "}"
+              << (i + 1 < json_rows.size() ? ",\n" : "\n");
+  }
+  std::cout << "]\n";
+}
+
+// Run body in a child process and report what it measured.
+static void run_case(bench_row row, const std::function<bench_metrics()> &body) {
+  std::cerr << "  " << row.suite << " " << row.name << " " << row.allocator
+            << " threads=" << row.threads << "\n";
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+  std::cout.flush();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    bench_metrics metrics = body();
+    ssize_t written = write(fds[1], &metrics, sizeof(metrics));
+    _exit(written == sizeof(metrics) ? 0 : 1);
+  }
+
+  close(fds[1]);
+  bench_metrics metrics;
+  bool received = read(fds[0], &metrics, sizeof(metrics)) == sizeof(metrics);
+  close(fds[0]);
+  int status = 0;
+  struct rusage usage = {};
+  wait4(pid, &status, 0, &usage);
+  if (!received || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    std::cerr << "  case failed\n";
+    return;
+  }
+
+  row.metrics = metrics;
+  row.peak_rss_kb = usage.ru_maxrss;
+  if (options.json) {
+    json_rows.push_back(row);
+  } else {
+    print_csv(row);
+  }
+}
+
+// ============================================================================
+// Allocators, size distributions and alloc/free patterns
+// ============================================================================
+
+struct bench_allocator {
+  const char *name;
+  void *(*alloc)(size_t size, size_t align); // align 0 means default
+  void (*free)(void *ptr, size_t size, size_t align);
+};
+
+static const bench_allocator allocators[] = {
+    {"memcpp",
+     [](size_t size, size_t align) {
+       return align == 0 ? mem_alloc(size) : mem_alloc_align(size, static_cast<Alignment>(align));
+     },
+     [](void *ptr, size_t, size_t) { mem_free(ptr); }},
+    {"malloc",
+     [](size_t size, size_t align) -> void * {
+       if (align == 0) return malloc(size);
+       void *ptr = nullptr;
+       return posix_memalign(&ptr, align, size) == 0 ? ptr : nullptr;
+     },
+     [](void *ptr, size_t, size_t) { free(ptr); }},
+    {"new/delete",
+     [](size_t size, size_t align) {
+       return align == 0 ? ::operator new(size) : ::operator new(size, std::align_val_t(align));
+     },
+     [](void *ptr, size_t size, size_t align) {
+       if (align == 0) {
+         ::operator delete(ptr, size);
+       } else {
+         ::operator delete(ptr, size, std::align_val_t(align));
+       }
+     }},
+};
+
+// Without --trace the trace distribution is a mix shaped like a typical
+// C++ service: mostly nodes and short strings, some buffers, rare large ones.
+static size_t builtin_trace_size(std::mt19937_64 &rng) {
+  std::uniform_int_distribution<int> bucket(0, 99);
+  int b = bucket(rng);
+  if (b < 60) return std::uniform_int_distribution<size_t>(16, 64)(rng);
+  if (b < 85) return std::uniform_int_distribution<size_t>(65, 512)(rng);
+  if (b < 95) return std::uniform_int_distribution<size_t>(513, 8192)(rng);
+  if (b < 99) return std::uniform_int_distribution<size_t>(8193, 128 * 1024)(rng);
+  return std::uniform_int_distribution<size_t>(128 * 1024 + 1, 1024 * 1024)(rng);
+}
+
+static std::vector<size_t> make_sizes(const std::string &dist, size_t count, uint64_t seed) {
+  std::mt19937_64 rng(seed);
+  std::uniform_int_distribution<size_t> uniform(16, 4096);
+  std::lognormal_distribution<double> lognormal(4.5, 1.2); // median ~90 bytes
+  std::vector<size_t> sizes(count);
+  for (size_t i = 0; i < count; ++i) {
+    if (dist == "fixed") {
+      sizes[i] = 64;
+    } else if (dist == "uniform") {
+      sizes[i] = uniform(rng);
+    } else if (dist == "lognormal") {
+      sizes[i] = std::clamp<size_t>((size_t)lognormal(rng), 1, 1024 * 1024);
+    } else if (!options.trace_sizes.empty()) {
+      sizes[i] = options.trace_sizes[i % options.trace_sizes.size()];
+    } else {
+      sizes[i] = builtin_trace_size(rng);
+    }
+  }
+  return sizes;
+}
+
+#define PATTERN_WINDOW 1024
+
+// Order in which a window of blocks is freed after being allocated.
+static std::vector<size_t> make_free_order(const std::string &pattern, uint64_t seed) {
+  std::vector<size_t> order(PATTERN_WINDOW);
+  for (size_t i = 0; i < PATTERN_WINDOW; ++i) {
+    order[i] = i;
+  }
+  if (pattern == "lifo") {
+    std::reverse(order.begin(), order.end());
+  } else if (pattern == "random") {
+    std::mt19937_64 rng(seed);
+    std::shuffle(order.begin(), order.end(), rng);
+  }
+  return order;
+}
+
+// Allocate a window of blocks, touch each one, free them in the given order,
+// for every window worth of sizes. Times each call when samples is given.
+static void run_pattern(const bench_allocator &a, const std::vector<size_t> &sizes,
+                        const std::vector<size_t> &order, size_t align, latency_samples *samples) {
+  void *window[PATTERN_WINDOW];
+  for (size_t base = 0; base + PATTERN_WINDOW <= sizes.size(); base += PATTERN_WINDOW) {
+    for (size_t i = 0; i < PATTERN_WINDOW; ++i) {
+      uint64_t start = samples ? now_ns() : 0;
+      window[i] = a.alloc(sizes[base + i], align);
+      if (samples) samples->add(start, now_ns());
+      *(volatile char *)window[i] = 1;
+    }
+    for (size_t i : order) {
+      uint64_t start = samples ? now_ns() : 0;
+      a.free(window[i], sizes[base + i], align);
+      if (samples) samples->add(start, now_ns());
+    }
+  }
+}
+
+static bench_metrics measure_pattern(const bench_allocator &a, const std::string &dist,
+                                     const std::string &pattern, size_t align, int threads) {
+  std::barrier sync(threads + 1);
+  std::vector<latency_samples> samples(threads);
+  auto worker = [&](int t) {
+    std::vector<size_t> sizes = make_sizes(dist, options.ops, options.seed + t);
+    std::vector<size_t> order = make_free_order(pattern, options.seed + t);
+    run_pattern(a, sizes, order, align, nullptr); // warm-up
+    sync.arrive_and_wait();
+    run_pattern(a, sizes, order, align, nullptr);
+    sync.arrive_and_wait();
+    samples[t].ns.reserve(2 * sizes.size());
+    run_pattern(a, sizes, order, align, &samples[t]);
+  };
+
+  std::vector<std::thread> pool;
+  for (int t = 0; t < threads; ++t) {
+    pool.emplace_back(worker, t);
+  }
+  sync.arrive_and_wait();
+  uint64_t start = now_ns();
+  sync.arrive_and_wait();
+  uint64_t end = now_ns();
+  for (auto &thread : pool) {
+    thread.join();
+  }
+
+  bench_metrics metrics;
+  metrics.ops = 2 * (options.ops / PATTERN_WINDOW) * PATTERN_WINDOW * threads;
+  metrics.seconds = (end - start) / 1e9;
+  latency_samples all;
+  for (latency_samples &s : samples) {
+    all.ns.insert(all.ns.end(), s.ns.begin(), s.ns.end());
+  }
+  all.summarize(metrics);
+  return metrics;
+}
+
+// ============================================================================
+// Suites
+// ============================================================================
+
+static void suite_patterns() {
+  std::cerr << "Benchmarking size distributions and alloc/free patterns...\n";
+  for (const char *dist : {"fixed", "uniform", "lognormal", "trace"}) {
+    for (const char *pattern : {"lifo", "fifo", "random"}) {
+      for (const bench_allocator &a : allocators) {
+        bench_row row{"patterns", std::string(dist) + "/" + pattern, a.name};
+        run_case(row, [&]() { return measure_pattern(a, dist, pattern, 0, 1); });
+      }
+    }
+  }
+}
+
+static void suite_aligned() {
+  std::cerr << "Benchmarking aligned allocations...\n";
+  for (size_t align : {64, 4096}) {
+    for (const bench_allocator &a : allocators) {
+      bench_row row{"aligned", "uniform/random", a.name};
+      row.alignment = align;
+      run_case(row, [&]() { return measure_pattern(a, "uniform", "random", align, 1); });
+    }
+  }
+}
+
+static void suite_scaling() {
+  std::cerr << "Benchmarking multithreaded scaling...\n";
+  for (int threads = 1; threads <= 64; threads *= 2) {
+    for (const bench_allocator &a : allocators) {
+      bench_row row{"scaling", "uniform/random", a.name};
+      row.threads = threads;
+      run_case(row, [&]() { return measure_pattern(a, "uniform", "random", 0, threads); });
+    }
+  }
+}
+
+// Free latency as the number of live blocks grows. Every other block is
+// freed so each free has to look at both (in use) neighbours, which used to
+// mean a walk from the head of the list.
+static void suite_free_latency() {
+  std::cerr << "Benchmarking free latency by heap size...\n";
+  size_t alloc_size = 2048; // above the thread cache, frees hit the heap
+  for (size_t n_blocks : {1000, 10000, 100000}) {
+    bench_row row{"free_latency", "live=" + std::to_string(n_blocks), "memcpp"};
+    run_case(row, [=]() {
+      std::vector<void *> ptrs(n_blocks);
+      for (size_t i = 0; i < n_blocks; ++i) {
+        ptrs[i] = mem_alloc(alloc_size);
+      }
+
+      latency_samples samples;
+      samples.ns.reserve(n_blocks / 2);
+      uint64_t start = now_ns();
+      for (size_t i = 0; i < n_blocks; i += 2) {
+        uint64_t call = now_ns();
+        mem_free(ptrs[i]);
+        samples.add(call, now_ns());
+      }
+      uint64_t end = now_ns();
+
+      bench_metrics metrics;
+      metrics.ops = n_blocks / 2;
+      metrics.seconds = (end - start) / 1e9;
+      samples.summarize(metrics);
+      return metrics;
+    });
+  }
+}
+
+// 48 byte tree node, the typical pool customer
+struct TreeNode {
+  TreeNode *left, *right, *parent;
+  int64_t key, value;
+  int32_t height;
+  TreeNode(int64_t k) : left(nullptr), right(nullptr), parent(nullptr), key(k), value(k), height(1) {}
+};
+
+// Node churn: build a working set, then repeatedly free a random node and
+// allocate a replacement, the pattern of a tree under inserts and deletes.
+template <typename Alloc, typename Free>
+bench_metrics node_churn(Alloc alloc_node, Free free_node) {
+  size_t live_nodes = 100000;
+  size_t churn_ops = 1000000;
+  std::mt19937 rng(options.seed);
+  std::vector<TreeNode *> nodes(live_nodes);
+
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < live_nodes; ++i) {
+    nodes[i] = alloc_node(i);
+  }
+  for (size_t i = 0; i < churn_ops; ++i) {
+    size_t victim = rng() % live_nodes;
+    free_node(nodes[victim]);
+    nodes[victim] = alloc_node(i);
+  }
+  for (TreeNode *node : nodes) {
+    free_node(node);
+  }
+  uint64_t end = now_ns();
+
+  bench_metrics metrics;
+  metrics.ops = 2 * (live_nodes + churn_ops);
+  metrics.seconds = (end - start) / 1e9;
+  return metrics;
+}
+
+static void suite_node_churn() {
+  std::cerr << "Benchmarking 48 byte node churn...\n";
+  run_case({"node_churn", "48B", "object_pool"}, []() {
+    memcpp::object_pool<TreeNode> pool(1024);
+    return node_churn([&](int64_t k) { return pool.create(k); },
+                      [&](TreeNode *n) { pool.destroy(n); });
+  });
+  run_case({"node_churn", "48B", "new/delete"}, []() {
+    return node_churn([](int64_t k) { return new TreeNode(k); },
+                      [](TreeNode *n) { delete n; });
+  });
+  run_case({"node_churn", "48B", "memcpp"}, []() {
+    return node_churn([](int64_t k) { return new (mem_alloc(sizeof(TreeNode))) TreeNode(k); },
+                      [](TreeNode *n) { n->~TreeNode(); mem_free(n); });
+  });
+  run_case({"node_churn", "48B", "memcpp_sized"}, []() {
+    return node_churn([](int64_t k) { return new (mem_alloc(sizeof(TreeNode))) TreeNode(k); },
+                      [](TreeNode *n) { n->~TreeNode(); mem_free_sized(n, sizeof(TreeNode)); });
+  });
+}
+
+// Rounds of 32 objects of one size, allocated and then freed in reverse, all
+// served by the thread cache. What is left is the cost of the calls: the
+// out-of-line ones against alloc<N> and dealloc<N> inlined into the loop.
+template <typename Alloc, typename Free>
+bench_metrics fixed_size_rounds(Alloc alloc_obj, Free free_obj) {
+  const size_t count = 32;
+  const size_t rounds = 100000;
+  void *ptrs[count];
+  auto round = [&]() {
+    for (size_t i = 0; i < count; ++i) {
+      ptrs[i] = alloc_obj();
+      *(volatile char *)ptrs[i] = 1;
+    }
+    for (size_t i = count; i-- > 0;) {
+      free_obj(ptrs[i]);
+    }
+  };
+  round(); // warm-up
+
+  uint64_t start = now_ns();
+  uint64_t start_cycles = now_cycles();
+  for (size_t r = 0; r < rounds; ++r) {
+    round();
+  }
+  uint64_t end_cycles = now_cycles();
+  uint64_t end = now_ns();
+
+  bench_metrics metrics;
+  metrics.ops = 2 * rounds * count;
+  metrics.seconds = (end - start) / 1e9;
+  metrics.cycles_per_op = (double)(end_cycles - start_cycles) / metrics.ops;
+  return metrics;
+}
+
+template <size_t N>
+static void inline_cases() {
+  std::string name = std::to_string(N) + "B";
+  run_case({"inline", name, "memcpp"}, []() {
+    return fixed_size_rounds([]() { return mem_alloc(N); }, [](void *p) { mem_free(p); });
+  });
+  run_case({"inline", name, "memcpp_sized"}, []() {
+    return fixed_size_rounds([]() { return mem_alloc(N); }, [](void *p) { mem_free_sized(p, N); });
+  });
+  run_case({"inline", name, "memcpp_inline"}, []() {
+    return fixed_size_rounds([]() { return memcpp::alloc<N>(); }, [](void *p) { memcpp::dealloc<N>(p); });
+  });
+  run_case({"inline", name, "malloc"}, []() {
+    return fixed_size_rounds([]() { return malloc(N); }, [](void *p) { free(p); });
+  });
+}
+
+static void suite_inline() {
+  std::cerr << "Benchmarking compile-time sizes against out-of-line calls...\n";
+  inline_cases<16>();
+  inline_cases<48>();
+  inline_cases<128>();
+  run_case({"inline", "TreeNode", "new/delete"}, []() {
+    return fixed_size_rounds([]() { return new TreeNode(1); },
+                             [](void *p) { delete static_cast<TreeNode *>(p); });
+  });
+  run_case({"inline", "TreeNode", "memcpp_make"}, []() {
+    return fixed_size_rounds([]() { return memcpp::make<TreeNode>(1); },
+                             [](void *p) { memcpp::destroy(static_cast<TreeNode *>(p)); });
+  });
+}
+
+// Replay the trace distribution (or --trace) against a live set of 4096
+// blocks, each step freeing a random one and allocating the next size. The
+// heap is read back at the end with the live set still in place, so the
+// fragmentation column shows how well the free space left over can serve a
+// large request.
+static bench_metrics fragmentation_trace() {
+  const size_t live_count = 4096;
+  std::vector<size_t> sizes = make_sizes("trace", options.ops, options.seed);
+  std::mt19937_64 rng(options.seed);
+  std::vector<void *> live;
+  size_t next = 0;
+  for (; next < live_count && next < sizes.size(); ++next) {
+    live.push_back(mem_alloc(sizes[next]));
+  }
+
+  uint64_t start = now_ns();
+  for (; next < sizes.size(); ++next) {
+    size_t victim = rng() % live.size();
+    mem_free(live[victim]);
+    live[victim] = mem_alloc(sizes[next]);
+    *(volatile char *)live[victim] = 1;
+  }
+  uint64_t end = now_ns();
+
+  mem_stats_t stats = mem_stats();
+  bench_metrics metrics;
+  metrics.ops = 2 * (sizes.size() - live.size());
+  metrics.seconds = (end - start) / 1e9;
+  metrics.has_fragmentation = true;
+  metrics.fragmentation = stats.fragmentation;
+  for (void *ptr : live) {
+    mem_free(ptr);
+  }
+  return metrics;
+}
+
+static void suite_fragmentation() {
+  std::cerr << "Benchmarking fragmentation under a mixed-size trace...\n";
+  run_case({"fragmentation", options.trace_sizes.empty() ? "builtin" : "trace", "memcpp"},
+           []() { return fragmentation_trace(); });
+}
+
+// What sampling adds to a mem_alloc/mem_free pair: off, at the default
+// rate of a heap profiler and at a dense one.
+static void suite_heap_profile() {
+  std::cerr << "Benchmarking the heap profiler's sampling cost...\n";
+  for (size_t size : {48, 4096}) {
+    std::string name = std::to_string(size) + "B";
+    for (size_t rate : {0, 512 * 1024, 16 * 1024}) {
+      std::string allocator = rate == 0 ? "memcpp" : "memcpp_profile=" + std::to_string(rate / 1024) + "K";
+      run_case({"heap_profile", name, allocator}, [=]() {
+        mem_config_t config = mem_get_config();
+        config.profile_sample_rate = rate;
+        mem_configure(config);
+        return fixed_size_rounds([=]() { return mem_alloc(size); }, [](void *p) { mem_free(p); });
+      });
+    }
+  }
+}
+
+// Link count blocks of size bytes into one cycle in random order and follow
+// it. Each step is a dependent load from a block that is most likely on
+// another page, so throughput is bound by cache and dTLB misses, and the
+// working set (128 MB) is far beyond what 4 KB TLB entries cover. One op is
+// one step.
+template <typename Alloc>
+bench_metrics pointer_chase(size_t size, Alloc alloc_block) {
+  const size_t working_set = (size_t)128 * 1024 * 1024;
+  size_t count = working_set / size;
+  std::vector<void **> nodes(count);
+  for (void **&node : nodes) {
+    node = static_cast<void **>(alloc_block(size));
+  }
+  std::vector<size_t> order(count);
+  for (size_t i = 0; i < count; ++i) {
+    order[i] = i;
+  }
+  std::mt19937_64 rng(options.seed);
+  std::shuffle(order.begin(), order.end(), rng);
+  for (size_t i = 0; i < count; ++i) {
+    *nodes[order[i]] = nodes[order[(i + 1) % count]];
+  }
+
+  size_t steps = std::max<size_t>(options.ops * 20, count);
+  void **node = nodes[order[0]];
+  for (size_t i = 0; i < count; ++i) {
+    node = static_cast<void **>(*node); // warm-up lap
+  }
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < steps; ++i) {
+    node = static_cast<void **>(*node);
+  }
+  uint64_t end = now_ns();
+  if (node == nullptr) abort();
+
+  bench_metrics metrics;
+  metrics.ops = steps;
+  metrics.seconds = (end - start) / 1e9;
+  return metrics;
+}
+
+static void suite_huge_pages() {
+  std::cerr << "Benchmarking pointer chasing over 128MB with huge pages...\n";
+  struct mode_case {
+    const char *allocator;
+    HugePages mode;
+  };
+  static const mode_case modes[] = {
+      {"memcpp", HUGE_PAGES_OFF},
+      {"memcpp_thp", HUGE_PAGES_MADVISE},
+      {"memcpp_hugetlb", HUGE_PAGES_HUGETLB},
   };
+  // 64 bytes come from slabs, 2 KB from the heap
+  for (size_t size : {64, 2048}) {
+    std::string name = std::to_string(size) + "B";
+    for (const mode_case &m : modes) {
+      run_case({"huge_pages", name, m.allocator}, [=]() {
+        mem_config_t config = mem_get_config();
+        config.huge_pages = m.mode;
+        mem_configure(config);
+        return pointer_chase(size, mem_alloc);
+      });
+    }
+    run_case({"huge_pages", name, "malloc"}, [=]() { return pointer_chase(size, malloc); });
+  }
+}
 
-  std::string documents_path = get_home_dir() + "/Documents";
-
-  // Benchmark: Memcpp With alignment
-  Alignment align = ALIGN_16;
-  std::cout << "Benchmarking aligned allocations (memcpp)...\n";
-  for (size_t i = 0; i < n_runs; ++i) {
-    auto start = std::chrono::high_resolution_clock::now();
-    void *addr = mem_alloc_align(alloc_size, align);
-    auto end = std::chrono::high_resolution_clock::now();
-
-    if (addr) {
-      if(with_free) mem_free(addr); // Free memory
-      auto duration =
-          std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-      memcpp_results.push_back(duration);
-    }
-  }
-
-  // Benchmark: malloc
-  std::cout << "Benchmarking malloc...\n";
-  for (size_t i = 0; i < n_runs; ++i) {
-    auto start = std::chrono::high_resolution_clock::now();
-    void *addr = malloc(alloc_size);
-    auto end = std::chrono::high_resolution_clock::now();
-
-    if (addr) {
-      if(with_free) free(addr); // Free memory
-      auto duration =
-          std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-      malloc_results.push_back(duration);
-    }
-  }
-  
-  // Benchmark: new/delete
-  std::cout << "Benchmarking new/delete...\n";
-  for (size_t i = 0; i < n_runs; ++i) {
-    auto start = std::chrono::high_resolution_clock::now();
-    char *addr = new char[alloc_size]; // Fixed: allocate actual bytes
-    auto end = std::chrono::high_resolution_clock::now();
-
-    if (addr) {
-      if(with_free) delete[] addr; // Fixed: use delete[] for array
-      auto duration =
-          std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-      new_delete_results.push_back(duration);
-    }
-  }
-  
-  // Ensure Documents directory exists
-  if (!std::filesystem::exists(documents_path)) {
-    std::cerr << "Warning: " << documents_path
-              << " does not exist. Using current directory.\n";
-    documents_path = ".";
-  }
-
-  // Extract values for plotting
-  std::vector<double> allocation_numbers_memcpp, memcpp_times;
-  std::vector<double> allocation_numbers_malloc, malloc_times;
-  std::vector<double> allocation_numbers_new_delete, new_delete_times;
-
-  // Memcpp results
-  for (size_t i = 0; i < memcpp_results.size(); ++i) {
-    allocation_numbers_memcpp.push_back(i + 1);
-    memcpp_times.push_back(memcpp_results[i].count());
-  }
-
-  // Malloc results
-  for (size_t i = 0; i < malloc_results.size(); ++i) {
-    allocation_numbers_malloc.push_back(i + 1);
-    malloc_times.push_back(malloc_results[i].count());
-  }
-
-  // New/delete results
-  for (size_t i = 0; i < new_delete_results.size(); ++i) {
-    allocation_numbers_new_delete.push_back(i + 1);
-    new_delete_times.push_back(new_delete_results[i].count());
-  }
-
-  // Plotting with matplot
-  using namespace matplot;
-
-  // Plot for memcpp allocations
-  figure();
-  plot(allocation_numbers_memcpp, memcpp_times);
-  title("Memcpp Allocation Times (64 bytes, ALIGN_16)");
-  xlabel("Allocation Number");
-  ylabel("Time (microseconds)");
-  grid(on);
-  std::string plot1_path = documents_path + "/memcpp_times.png";
-  save(plot1_path);
-  std::cout << "Memcpp plot saved to: " << plot1_path << "\n";
-
-  // Plot for malloc allocations
-  figure();
-  plot(allocation_numbers_malloc, malloc_times);
-  title("Malloc Allocation Times (64 bytes)");
-  xlabel("Allocation Number");
-  ylabel("Time (microseconds)");
-  grid(on);
-  std::string plot2_path = documents_path + "/malloc_times.png";
-  save(plot2_path);
-  std::cout << "Malloc plot saved to: " << plot2_path << "\n";
-
-  // Plot for new/delete allocations
-  figure();
-  plot(allocation_numbers_new_delete, new_delete_times);
-  title("New/Delete Allocation Times (64 bytes)");
-  xlabel("Allocation Number");
-  ylabel("Time (microseconds)");
-  grid(on);
-  std::string plot3_path = documents_path + "/new_delete_times.png";
-  save(plot3_path);
-  std::cout << "New/delete plot saved to: " << plot3_path << "\n";
-
-  // Comparison plot (all three on same graph)
-  figure();
-  hold(on);
-  plot(allocation_numbers_memcpp, memcpp_times)->display_name("Memcpp (aligned)");
-  plot(allocation_numbers_malloc, malloc_times)->display_name("Malloc");
-  plot(allocation_numbers_new_delete, new_delete_times)->display_name("New/Delete");
-  hold(off);
-  title("Allocation Time Comparison (64 bytes)");
-  xlabel("Allocation Number");
-  ylabel("Time (microseconds)");
-  legend();
-  grid(on);
-  std::string plot4_path = documents_path + "/comparison_plot.png";
-  save(plot4_path);
-  std::cout << "Comparison plot saved to: " << plot4_path << "\n";
-}
-
-int main() { successive_allocations();}
+// Build and tear down sets of equal-size nodes, count at a time, the way a
+// graph is built and dropped. Looped calls take the lock (or the thread
+// cache) once per block, the batch calls once per set.
+template <typename AllocSet, typename FreeSet>
+bench_metrics batch_rounds(size_t rounds, size_t count, AllocSet alloc_set, FreeSet free_set) {
+  std::vector<void *> ptrs(count);
+  auto round = [&]() {
+    alloc_set(ptrs.data());
+    for (void *ptr : ptrs) {
+      *(volatile char *)ptr = 1;
+    }
+    free_set(ptrs.data());
+  };
+  round(); // warm-up
+
+  uint64_t start = now_ns();
+  for (size_t r = 0; r < rounds; ++r) {
+    round();
+  }
+  uint64_t end = now_ns();
+
+  bench_metrics metrics;
+  metrics.ops = 2 * rounds * count;
+  metrics.seconds = (end - start) / 1e9;
+  return metrics;
+}
+
+static void suite_batch() {
+  std::cerr << "Benchmarking batch against looped calls...\n";
+  for (size_t size : {48, 256, 4096}) {
+    for (size_t count : {64, 1024, 16384}) {
+      std::string name = std::to_string(size) + "Bx" + std::to_string(count);
+      size_t rounds = std::max<size_t>(1, options.ops / count);
+      run_case({"batch", name, "memcpp"}, [=]() {
+        return batch_rounds(
+            rounds, count,
+            [=](void **ptrs) { for (size_t i = 0; i < count; ++i) ptrs[i] = mem_alloc(size); },
+            [=](void **ptrs) { for (size_t i = 0; i < count; ++i) mem_free(ptrs[i]); });
+      });
+      run_case({"batch", name, "memcpp_batch"}, [=]() {
+        return batch_rounds(
+            rounds, count,
+            [=](void **ptrs) {
+              if (mem_alloc_batch(size, count, ptrs) != count) abort();
+            },
+            [=](void **ptrs) { mem_free_batch(ptrs, count); });
+      });
+      run_case({"batch", name, "malloc"}, [=]() {
+        return batch_rounds(
+            rounds, count,
+            [=](void **ptrs) { for (size_t i = 0; i < count; ++i) ptrs[i] = malloc(size); },
+            [=](void **ptrs) { for (size_t i = 0; i < count; ++i) free(ptrs[i]); });
+      });
+    }
+  }
+}
+
+// Container heavy workload: grow vectors, fill a hash map, build strings.
+// One op is one round.
+template <template <typename> class Alloc> bench_metrics container_workload() {
+  using string_t = std::basic_string<char, std::char_traits<char>, Alloc<char>>;
+  using map_t = std::unordered_map<int, string_t, std::hash<int>, std::equal_to<int>,
+                                   Alloc<std::pair<const int, string_t>>>;
+  size_t rounds = 20;
+
+  uint64_t start = now_ns();
+  for (size_t round = 0; round < rounds; ++round) {
+    std::vector<int, Alloc<int>> values;
+    for (int i = 0; i < 100000; ++i) {
+      values.push_back(i);
+    }
+    map_t names;
+    for (int i = 0; i < 20000; ++i) {
+      names.emplace(i, string_t(24 + i % 40, 'x'));
+    }
+    for (int i = 0; i < 20000; i += 2) {
+      names.erase(i);
+    }
+  }
+  uint64_t end = now_ns();
+
+  bench_metrics metrics;
+  metrics.ops = rounds;
+  metrics.seconds = (end - start) / 1e9;
+  return metrics;
+}
+
+static void suite_containers() {
+  std::cerr << "Benchmarking std containers...\n";
+  run_case({"containers", "vector+map+string", "std::allocator"},
+           []() { return container_workload<std::allocator>(); });
+  run_case({"containers", "vector+map+string", "memcpp::allocator"},
+           []() { return container_workload<memcpp::allocator>(); });
+  run_case({"containers", "vector+map+string", "pmr+memcpp::memory_resource"}, []() {
+    // polymorphic_allocator picks up the default resource
+    std::pmr::set_default_resource(memcpp::get_memory_resource());
+    return container_workload<std::pmr::polymorphic_allocator>();
+  });
+}
+
+// Medium blocks bypass the thread caches and hit the sharded heaps directly.
+template <typename Alloc, typename Free>
+bench_metrics heap_throughput(int num_threads, Alloc alloc_block, Free free_block) {
+  const int ops_per_thread = 100000;
+  auto worker = [&](int seed) {
+    void *window[16] = {};
+    for (int i = 0; i < ops_per_thread; ++i) {
+      int slot = (i * 7 + seed) & 15;
+      if (window[slot] != nullptr) {
+        free_block(window[slot]);
+      }
+      window[slot] = alloc_block(2048 + (size_t)((i + seed) % 8) * 2048);
+    }
+    for (void *ptr : window) {
+      free_block(ptr);
+    }
+  };
+
+  uint64_t start = now_ns();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back(worker, t);
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  uint64_t end = now_ns();
+
+  bench_metrics metrics;
+  metrics.ops = 2 * (size_t)num_threads * ops_per_thread;
+  metrics.seconds = (end - start) / 1e9;
+  return metrics;
+}
+
+static void suite_heap_select() {
+  std::cerr << "Benchmarking 2-16KB alloc/free by heap selection...\n";
+  for (HeapSelect select : {HEAP_SELECT_CPU, HEAP_SELECT_THREAD}) {
+    for (int threads = 1; threads <= 64; threads *= 2) {
+      bench_row row{"heap_select", select == HEAP_SELECT_CPU ? "cpu" : "thread", "memcpp"};
+      row.threads = threads;
+      run_case(row, [=]() {
+        mem_config_t config = mem_get_config();
+        config.heap_select = select;
+        mem_configure(config);
+        return heap_throughput(threads, mem_alloc, mem_free);
+      });
+    }
+  }
+}
+
+// Windows of small objects larger than a thread cache bin, so every round
+// refills and flushes the caches through the slab classes. One op is one
+// alloc or one free.
+template <typename Alloc, typename Free>
+bench_metrics slab_refill(int num_threads, Alloc alloc_obj, Free free_obj) {
+  const int rounds = 1000;
+  const int window = 512;
+  auto worker = [&](int seed) {
+    std::vector<void *> objs(window);
+    for (int round = 0; round < rounds; ++round) {
+      for (int i = 0; i < window; ++i) {
+        objs[i] = alloc_obj(16 + (size_t)((i + seed) % 8) * 16);
+      }
+      for (void *ptr : objs) {
+        free_obj(ptr);
+      }
+    }
+  };
+
+  uint64_t start = now_ns();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back(worker, t);
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  uint64_t end = now_ns();
+
+  bench_metrics metrics;
+  metrics.ops = 2 * (size_t)num_threads * rounds * window;
+  metrics.seconds = (end - start) / 1e9;
+  return metrics;
+}
+
+static void suite_slab_refill() {
+  std::cerr << "Benchmarking 16-128 byte slab refills across threads...\n";
+  for (int threads = 1; threads <= 64; threads *= 2) {
+    bench_row row{"slab_refill", "window=512", "memcpp"};
+    row.threads = threads;
+    run_case(row, [=]() { return slab_refill(threads, mem_alloc, mem_free); });
+    row.allocator = "malloc";
+    run_case(row, [=]() { return slab_refill(threads, malloc, free); });
+  }
+}
+
+// One thread allocates 512-4096 byte messages and hands them over a ring,
+// another frees them. One op is one message.
+template <typename Alloc, typename Free>
+bench_metrics producer_consumer(Alloc alloc_msg, Free free_msg) {
+  const size_t messages = 500000;
+  const size_t ring_size = 1024;
+  std::vector<std::atomic<void *>> ring(ring_size);
+
+  uint64_t start = now_ns();
+  std::thread consumer([&]() {
+    for (size_t i = 0; i < messages; ++i) {
+      std::atomic<void *> &slot = ring[i % ring_size];
+      void *msg;
+      while ((msg = slot.load(std::memory_order_acquire)) == nullptr) {
+        std::this_thread::yield();
+      }
+      slot.store(nullptr, std::memory_order_relaxed);
+      free_msg(msg);
+    }
+  });
+  for (size_t i = 0; i < messages; ++i) {
+    std::atomic<void *> &slot = ring[i % ring_size];
+    while (slot.load(std::memory_order_acquire) != nullptr) {
+      std::this_thread::yield();
+    }
+    size_t size = 512 + (i % 8) * 512;
+    void *msg = alloc_msg(size);
+    *(size_t *)msg = size;
+    slot.store(msg, std::memory_order_release);
+  }
+  consumer.join();
+  uint64_t end = now_ns();
+
+  bench_metrics metrics;
+  metrics.ops = messages;
+  metrics.seconds = (end - start) / 1e9;
+  return metrics;
+}
+
+static void suite_producer_consumer() {
+  std::cerr << "Benchmarking producer/consumer frees...\n";
+  // a single heap: frees only go remote while the producer holds the lock,
+  // a heap per thread: every free is pushed to the producer's heap
+  for (size_t heaps : {1, 2}) {
+    bench_row row{"producer_consumer", "heaps=" + std::to_string(heaps), "memcpp", 2};
+    run_case(row, [=]() {
+      mem_config_t config = mem_get_config();
+      config.heap_count = heaps;
+      config.heap_select = HEAP_SELECT_THREAD;
+      mem_configure(config);
+      return producer_consumer(mem_alloc, mem_free);
+    });
+  }
+  run_case({"producer_consumer", "-", "malloc", 2}, []() { return producer_consumer(malloc, free); });
+}
+
+struct bench_suite {
+  const char *name;
+  void (*run)();
+};
+
+static const bench_suite suites[] = {
+    {"patterns", suite_patterns},
+    {"aligned", suite_aligned},
+    {"scaling", suite_scaling},
+    {"free_latency", suite_free_latency},
+    {"node_churn", suite_node_churn},
+    {"batch", suite_batch},
+    {"inline", suite_inline},
+    {"fragmentation", suite_fragmentation},
+    {"huge_pages", suite_huge_pages},
+    {"heap_profile", suite_heap_profile},
+    {"containers", suite_containers},
+    {"heap_select", suite_heap_select},
+    {"slab_refill", suite_slab_refill},
+    {"producer_consumer", suite_producer_consumer},
+};
+
+static void usage(const char *argv0) {
+  std::cerr << "usage: " << argv0
+            << " [--format csv|json] [--suite NAME]... [--ops N] [--seed N] [--trace FILE]\n"
+            << "suites:";
+  for (const bench_suite &suite : suites) {
+    std::cerr << " " << suite.name;
+  }
+  std::cerr << "\n";
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) usage(argv[0]);
+    std::string value = argv[++i];
+    if (arg == "--format" && (value == "csv" || value == "json")) {
+      options.json = value == "json";
+    } else if (arg == "--suite") {
+      options.suites.push_back(value);
+    } else if (arg == "--ops") {
+      options.ops = std::max<size_t>(std::stoull(value), PATTERN_WINDOW);
+    } else if (arg == "--seed") {
+      options.seed = std::stoull(value);
+    } else if (arg == "--trace") {
+      // one allocation size per line, replayed in order
+      std::ifstream trace(value);
+      size_t size;
+      while (trace >> size) {
+        options.trace_sizes.push_back(size);
+      }
+      if (options.trace_sizes.empty()) {
+        std::cerr << "no sizes in " << value << "\n";
+        return 1;
+      }
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+#ifndef __OPTIMIZE__
+  std::cerr << "warning: unoptimized build, configure with -DCMAKE_BUILD_TYPE=Release\n";
+#endif
+  timer_overhead = measure_timer_overhead();
+
+  if (!options.json) print_csv_header();
+  for (const bench_suite &suite : suites) {
+    if (options.suites.empty() ||
+        std::find(options.suites.begin(), options.suites.end(), suite.name) != options.suites.end()) {
+      suite.run();
+    }
+  }
+  if (options.json) print_json();
+}
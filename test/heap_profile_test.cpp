@@ -0,0 +1,217 @@
+#include <gtest/gtest.h>
+#include "../include/alloc.hpp"
+#include "../include/heap_profile.hpp"
+#include "../include/inline_alloc.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Exported, and not cloned for a constant size, so dladdr can name it
+extern "C" __attribute__((noipa)) void* heap_profile_test_caller(size_t size) {
+    void* ptr = mem_alloc(size);
+    asm volatile("" ::: "memory"); // keep the call from becoming a tail call
+    return ptr;
+}
+
+namespace {
+
+// Samples every allocation of 32 bytes or more while in scope
+struct ScopedProfile {
+    mem_config_t saved;
+    explicit ScopedProfile(size_t rate = 1) : saved(mem_get_config()) {
+        mem_config_t config = saved;
+        config.profile_sample_rate = rate;
+        mem_configure(config);
+    }
+    ~ScopedProfile() { mem_configure(saved); }
+};
+
+std::string dump_profile(ProfileFormat format) {
+    std::string path = testing::TempDir() + "memcpp_heap_profile";
+    EXPECT_TRUE(mem_heap_profile_dump(path.c_str(), format));
+    std::ifstream file(path);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    std::remove(path.c_str());
+    return contents.str();
+}
+
+// Live samples and their bytes, from the pprof header
+std::pair<size_t, size_t> live_samples() {
+    std::string profile = dump_profile(PROFILE_PPROF);
+    size_t objects = 0, bytes = 0;
+    EXPECT_EQ(sscanf(profile.c_str(), "heap profile: %zu: %zu", &objects, &bytes), 2) << profile;
+    return {objects, bytes};
+}
+
+// Estimated bytes of the collapsed stacks that contain frame
+double estimated_bytes(const std::string& collapsed, const std::string& frame) {
+    std::istringstream lines(collapsed);
+    std::string line;
+    double total = 0;
+    while(std::getline(lines, line)) {
+        size_t space = line.rfind(' ');
+        if(space != std::string::npos && line.find(frame) < space) total += std::stod(line.substr(space + 1));
+    }
+    return total;
+}
+
+}
+
+// ============================================================================
+// Sampling Tests
+// ============================================================================
+
+TEST(HeapProfileTest, OffByDefault) {
+    EXPECT_EQ(mem_get_config().profile_sample_rate, 0u);
+    void* ptr = mem_alloc(4096);
+    EXPECT_EQ(heap_profile_samples.load(), 0u);
+
+    std::string profile = dump_profile(PROFILE_PPROF);
+    EXPECT_EQ(profile.rfind("heap profile: 0: 0 [0: 0] @ heap_v2/", 0), 0u) << profile;
+    EXPECT_NE(profile.find("MAPPED_LIBRARIES:"), std::string::npos);
+    mem_free(ptr);
+}
+
+TEST(HeapProfileTest, SamplesLiveUntilFreed) {
+    ScopedProfile profile;
+    EXPECT_EQ(mem_get_config().profile_sample_rate, 1u);
+    std::vector<void*> ptrs;
+    for(int i = 0; i < 10; i++) {
+        ptrs.push_back(mem_alloc(1000));
+    }
+    EXPECT_EQ(live_samples(), (std::pair<size_t, size_t>{10, 10000}));
+
+    for(void* ptr : ptrs) {
+        mem_free(ptr);
+    }
+    EXPECT_EQ(live_samples(), (std::pair<size_t, size_t>{0, 0}));
+}
+
+TEST(HeapProfileTest, StoppingKeepsTheSamplesTaken) {
+    void* ptr;
+    {
+        ScopedProfile profile;
+        ptr = mem_alloc(200);
+    }
+    void* unsampled = mem_alloc(200);
+    EXPECT_EQ(live_samples().first, 1u);
+    mem_free(unsampled);
+    mem_free(ptr);
+    EXPECT_EQ(live_samples().first, 0u);
+}
+
+TEST(HeapProfileTest, EveryFreePathDropsItsSample) {
+    ScopedProfile profile;
+    void* slab = mem_alloc(48);
+    void* aligned = mem_alloc_align(300, ALIGN_64);
+    void* zeroed = mem_calloc(10, 100);
+    void* moved = mem_alloc(64);
+    void* large = mem_alloc(1024 * 1024);
+    void* batch[16];
+    ASSERT_EQ(mem_alloc_batch(2000, 16, batch), 16u);
+    void* inline_obj = memcpp::alloc<40>();
+    EXPECT_EQ(live_samples().first, 22u);
+
+    mem_free_sized(slab, 48);
+    mem_free_aligned_sized(aligned, 300, ALIGN_64);
+    mem_free(zeroed);
+    moved = mem_realloc(moved, 5000);
+    mem_free_batch(batch, 16);
+    memcpp::dealloc<40>(inline_obj);
+    // the realloc took a new sample for the block it moved to
+    EXPECT_EQ(live_samples(), (std::pair<size_t, size_t>{2, 1024 * 1024 + 5000}));
+
+    large = mem_realloc(large, 2 * 1024 * 1024);
+    mem_free(moved);
+    mem_free(large);
+    EXPECT_EQ(live_samples().first, 0u);
+}
+
+TEST(HeapProfileTest, ThreadsShareOneProfile) {
+    ScopedProfile profile;
+    const int threads = 4, per_thread = 1000;
+    std::vector<std::vector<void*>> ptrs(threads);
+    std::vector<std::thread> workers;
+    for(int t = 0; t < threads; t++) {
+        workers.emplace_back([&ptrs, t]() {
+            for(int i = 0; i < per_thread; i++) ptrs[t].push_back(mem_alloc(64 + t * 64));
+        });
+    }
+    for(auto& worker : workers) worker.join();
+    EXPECT_EQ(live_samples().first, (size_t)threads * per_thread);
+
+    // freed from other threads than the ones that allocated
+    workers.clear();
+    for(int t = 0; t < threads; t++) {
+        workers.emplace_back([&ptrs, t]() {
+            for(void* ptr : ptrs[(t + 1) % threads]) mem_free(ptr);
+        });
+    }
+    for(auto& worker : workers) worker.join();
+    EXPECT_EQ(live_samples().first, 0u);
+}
+
+TEST(HeapProfileTest, EstimatesTheBytesAllocated) {
+    const size_t rate = 64 * 1024;
+    const size_t count = 20000, size = 1000;
+    ScopedProfile profile(rate);
+    std::vector<void*> ptrs;
+    for(size_t i = 0; i < count; i++) {
+        ptrs.push_back(heap_profile_test_caller(size));
+    }
+
+    // about count * size / rate samples, each standing for rate bytes
+    size_t samples = live_samples().first;
+    EXPECT_GT(samples, 200u);
+    EXPECT_LT(samples, 420u);
+    double estimate = estimated_bytes(dump_profile(PROFILE_COLLAPSED), "heap_profile_test_caller");
+    EXPECT_NEAR(estimate, (double)(count * size), 0.2 * count * size);
+
+    for(void* ptr : ptrs) {
+        mem_free(ptr);
+    }
+}
+
+// ============================================================================
+// Output Tests
+// ============================================================================
+
+TEST(HeapProfileTest, PprofGroupsEqualStacks) {
+    ScopedProfile profile;
+    std::vector<void*> ptrs;
+    for(int i = 0; i < 5; i++) {
+        ptrs.push_back(heap_profile_test_caller(128));
+    }
+
+    std::string text = dump_profile(PROFILE_PPROF);
+    EXPECT_EQ(text.rfind("heap profile: 5: 640 [5: 640] @ heap_v2/1\n", 0), 0u) << text;
+    // one line for the loop, its frames as return addresses
+    EXPECT_NE(text.find("\n5: 640 [5: 640] @ 0x"), std::string::npos) << text;
+
+    for(void* ptr : ptrs) {
+        mem_free(ptr);
+    }
+}
+
+TEST(HeapProfileTest, CollapsedStacksNameTheCallers) {
+    ScopedProfile profile;
+    void* ptr = heap_profile_test_caller(4096);
+
+    std::string text = dump_profile(PROFILE_COLLAPSED);
+    size_t caller = text.find("heap_profile_test_caller;");
+    ASSERT_NE(caller, std::string::npos) << text;
+    // outermost frame first, the allocation itself last
+    EXPECT_NE(text.find("mem_alloc", caller), std::string::npos) << text;
+    EXPECT_NEAR(estimated_bytes(text, "heap_profile_test_caller"), 4096.0, 1.0);
+
+    mem_free(ptr);
+}
+
+TEST(HeapProfileTest, DumpFailsOnABadPath) {
+    EXPECT_FALSE(mem_heap_profile_dump("/nonexistent/dir/profile"));
+}
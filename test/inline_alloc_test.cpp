@@ -0,0 +1,169 @@
+#include <gtest/gtest.h>
+#include "../include/inline_alloc.hpp"
+#include "../include/alloc.hpp"
+#include "../include/stats.hpp"
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+struct Point {
+    double x, y, z;
+    Point(double x, double y, double z) : x(x), y(y), z(z) {}
+};
+
+struct alignas(32) Wide {
+    uint64_t lanes[4] = {};
+};
+
+struct Throws {
+    int value;
+    explicit Throws(int v) : value(v) { if(v < 0) throw std::invalid_argument("negative"); }
+};
+
+struct Tracked {
+    static int live;
+    char payload[40];
+    Tracked() { live++; }
+    ~Tracked() { live--; }
+};
+int Tracked::live = 0;
+
+template<size_t N, Alignment A>
+void check_roundtrip() {
+    void* ptr = memcpp::alloc<N, A>();
+    ASSERT_NE(ptr, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % A, 0u) << N << " bytes at " << A;
+    EXPECT_GE(mem_usable_size(ptr), N);
+    memset(ptr, 0xAB, N);
+    memcpp::dealloc<N, A>(ptr);
+}
+
+}
+
+// ============================================================================
+// Compile-Time Size Tests
+// ============================================================================
+
+TEST(InlineAllocTest, SizesAndAlignments) {
+    check_roundtrip<1, ALIGN_8>();
+    check_roundtrip<8, ALIGN_8>();
+    check_roundtrip<24, ALIGN_8>();
+    check_roundtrip<48, ALIGN_16>();
+    check_roundtrip<100, ALIGN_4>();
+    check_roundtrip<128, ALIGN_128>();
+    check_roundtrip<64, ALIGN_64>();
+    // No slab class fits these
+    check_roundtrip<120, ALIGN_64>();
+    check_roundtrip<200, ALIGN_8>();
+    check_roundtrip<32, ALIGN_4096>();
+    check_roundtrip<64 * 1024, ALIGN_16>();
+    check_roundtrip<1024 * 1024, ALIGN_256>();
+}
+
+TEST(InlineAllocTest, SharesTheThreadCacheWithMemAlloc) {
+    void* warm = mem_alloc(48);
+    mem_free(warm);
+
+    void* ptr = memcpp::alloc<48>();
+    memcpp::dealloc<48>(ptr);
+    void* again = mem_alloc(48);
+    EXPECT_EQ(again, ptr);
+
+    mem_free(again);
+    void* inline_again = memcpp::alloc<48>();
+    EXPECT_EQ(inline_again, again);
+    memcpp::dealloc<48>(inline_again);
+}
+
+TEST(InlineAllocTest, CountsLikeTheOutOfLineCalls) {
+    void* warm = memcpp::alloc<40>();
+    memcpp::dealloc<40>(warm);
+
+    mem_stats_t before = mem_stats();
+    void* ptrs[10];
+    for(void*& ptr : ptrs) ptr = memcpp::alloc<40>();
+    mem_stats_t during = mem_stats();
+    for(void* ptr : ptrs) memcpp::dealloc<40>(ptr);
+    mem_stats_t after = mem_stats();
+
+    EXPECT_EQ(during.allocations - before.allocations, 10u);
+    EXPECT_EQ(during.histogram[mem_stats_bucket(40)] - before.histogram[mem_stats_bucket(40)], 10u);
+    EXPECT_EQ(during.bytes_in_use - before.bytes_in_use, 10 * mem_usable_size(ptrs[0]));
+    EXPECT_EQ(after.frees - during.frees, 10u);
+    EXPECT_EQ(after.bytes_in_use, before.bytes_in_use);
+}
+
+TEST(InlineAllocTest, FreesPastTheBinCapacity) {
+    const size_t count = 1000;
+    void** ptrs = static_cast<void**>(mem_alloc(count * sizeof(void*)));
+    mem_stats_t before = mem_stats();
+    for(size_t i = 0; i < count; i++) ptrs[i] = memcpp::alloc<16>();
+    for(size_t i = 0; i < count; i++) memcpp::dealloc<16>(ptrs[i]);
+    mem_stats_t after = mem_stats();
+    EXPECT_EQ(after.bytes_in_use, before.bytes_in_use);
+    mem_free(ptrs);
+}
+
+TEST(InlineAllocTest, DoubleFreeIsIgnored) {
+    void* ptr = memcpp::alloc<32>();
+    memcpp::dealloc<32>(ptr);
+    memcpp::dealloc<32>(ptr);
+
+    void* first = memcpp::alloc<32>();
+    void* second = memcpp::alloc<32>();
+    EXPECT_NE(first, second);
+    memcpp::dealloc<32>(first);
+    memcpp::dealloc<32>(second);
+}
+
+TEST(InlineAllocTest, MismatchIsCaughtInDebugBuilds) {
+    void* ptr = memcpp::alloc<64>();
+    // a release build takes the object into a smaller class, which is safe
+    EXPECT_DEBUG_DEATH(memcpp::dealloc<16>(ptr), "size does not match");
+#ifndef NDEBUG
+    // the death test ran in a child, the object is still live here
+    memcpp::dealloc<64>(ptr);
+#endif
+}
+
+// ============================================================================
+// make and destroy Tests
+// ============================================================================
+
+TEST(InlineAllocTest, MakeConstructs) {
+    Point* p = memcpp::make<Point>(1.0, 2.0, 3.0);
+    ASSERT_NE(p, nullptr);
+    EXPECT_EQ(p->x, 1.0);
+    EXPECT_EQ(p->y, 2.0);
+    EXPECT_EQ(p->z, 3.0);
+    memcpp::destroy(p);
+
+    Wide* w = memcpp::make<Wide>();
+    ASSERT_NE(w, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(w) % alignof(Wide), 0u);
+    EXPECT_EQ(w->lanes[3], 0u);
+    memcpp::destroy(w);
+
+    memcpp::destroy<Point>(nullptr);
+}
+
+TEST(InlineAllocTest, DestroyRunsTheDestructor) {
+    Tracked* objs[100];
+    for(Tracked*& obj : objs) obj = memcpp::make<Tracked>();
+    EXPECT_EQ(Tracked::live, 100);
+    for(Tracked* obj : objs) memcpp::destroy(obj);
+    EXPECT_EQ(Tracked::live, 0);
+}
+
+TEST(InlineAllocTest, ThrowingConstructorGivesTheMemoryBack) {
+    Throws* warm = memcpp::make<Throws>(1);
+    memcpp::destroy(warm);
+
+    mem_stats_t before = mem_stats();
+    EXPECT_THROW(memcpp::make<Throws>(-1), std::invalid_argument);
+    mem_stats_t after = mem_stats();
+    EXPECT_EQ(after.bytes_in_use, before.bytes_in_use);
+    EXPECT_EQ(after.frees - before.frees, 1u);
+}
@@ -0,0 +1,144 @@
+#include <gtest/gtest.h>
+#include "../include/object_pool.hpp"
+#include <cstdint>
+#include <set>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct TreeNode {
+    TreeNode* left;
+    TreeNode* right;
+    TreeNode* parent;
+    int64_t key;
+    int64_t value;
+    int32_t height;
+
+    TreeNode(int64_t k, int64_t v)
+        : left(nullptr), right(nullptr), parent(nullptr), key(k), value(v), height(1) {}
+};
+
+struct alignas(64) CacheLine {
+    uint64_t counter = 0;
+};
+
+struct Tracked {
+    static int live;
+    Tracked() { live++; }
+    ~Tracked() { live--; }
+};
+int Tracked::live = 0;
+
+}
+
+// ============================================================================
+// Object Pool Tests
+// ============================================================================
+
+TEST(ObjectPoolTest, CreateAndDestroy) {
+    memcpp::object_pool<TreeNode> pool;
+
+    TreeNode* node = pool.create(42, 7);
+    ASSERT_NE(node, nullptr);
+    EXPECT_EQ(node->key, 42);
+    EXPECT_EQ(node->value, 7);
+    EXPECT_EQ(node->left, nullptr);
+
+    pool.destroy(node);
+}
+
+TEST(ObjectPoolTest, NoPerObjectHeader) {
+    memcpp::object_pool<TreeNode> pool(64);
+
+    // Objects from the same slab are exactly sizeof(T) apart
+    TreeNode* a = pool.create(1, 1);
+    TreeNode* b = pool.create(2, 2);
+    EXPECT_EQ(reinterpret_cast<char*>(b) - reinterpret_cast<char*>(a),
+              (ptrdiff_t)sizeof(TreeNode));
+
+    pool.destroy(a);
+    pool.destroy(b);
+}
+
+TEST(ObjectPoolTest, ReusesFreedSlots) {
+    memcpp::object_pool<TreeNode> pool;
+
+    TreeNode* a = pool.create(1, 1);
+    pool.destroy(a);
+    TreeNode* b = pool.create(2, 2);
+    EXPECT_EQ(a, b);
+    pool.destroy(b);
+}
+
+TEST(ObjectPoolTest, RespectsTypeAlignment) {
+    memcpp::object_pool<CacheLine> pool(16);
+
+    std::vector<CacheLine*> lines;
+    for(int i = 0; i < 100; i++) {
+        CacheLine* line = pool.create();
+        ASSERT_NE(line, nullptr);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(line) % 64, 0u);
+        lines.push_back(line);
+    }
+    for(CacheLine* line : lines) {
+        pool.destroy(line);
+    }
+}
+
+TEST(ObjectPoolTest, ManyObjectsAreDistinct) {
+    memcpp::object_pool<TreeNode> pool(128);
+
+    std::vector<TreeNode*> nodes;
+    std::set<TreeNode*> unique;
+    for(int i = 0; i < 10000; i++) {
+        TreeNode* node = pool.create(i, i * 2);
+        ASSERT_NE(node, nullptr);
+        nodes.push_back(node);
+        unique.insert(node);
+    }
+    EXPECT_EQ(unique.size(), nodes.size());
+
+    for(int i = 0; i < 10000; i++) {
+        EXPECT_EQ(nodes[i]->key, i);
+        EXPECT_EQ(nodes[i]->value, i * 2);
+        pool.destroy(nodes[i]);
+    }
+}
+
+TEST(ObjectPoolTest, DestroyRunsDestructor) {
+    memcpp::object_pool<Tracked> pool;
+
+    Tracked* t = pool.create();
+    EXPECT_EQ(Tracked::live, 1);
+    pool.destroy(t);
+    EXPECT_EQ(Tracked::live, 0);
+}
+
+TEST(ObjectPoolTest, ConcurrentPool) {
+    memcpp::concurrent_object_pool<TreeNode> pool;
+    const int num_threads = 4;
+    const int per_thread = 5000;
+
+    auto worker = [&pool](int id) {
+        std::vector<TreeNode*> nodes;
+        for(int i = 0; i < per_thread; i++) {
+            TreeNode* node = pool.create(id, i);
+            ASSERT_NE(node, nullptr);
+            nodes.push_back(node);
+        }
+        for(int i = 0; i < per_thread; i++) {
+            EXPECT_EQ(nodes[i]->key, id);
+            EXPECT_EQ(nodes[i]->value, i);
+            pool.destroy(nodes[i]);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(int i = 0; i < num_threads; i++) {
+        threads.emplace_back(worker, i);
+    }
+    for(auto& t : threads) {
+        t.join();
+    }
+}
@@ -0,0 +1,202 @@
+#include <gtest/gtest.h>
+#include "../include/stats.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <new>
+#include <thread>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Runs with LD_PRELOAD=libmemcpp_preload.so and links nothing of memcpp, the
+// library is reached through the malloc family and by dlsym for its stats.
+static mem_stats_t preloaded_stats() {
+    auto stats = (mem_stats_t (*)())dlsym(RTLD_DEFAULT, "_Z9mem_statsv");
+    if(stats == nullptr) {
+        ADD_FAILURE() << "libmemcpp_preload.so is not preloaded";
+        return mem_stats_t{};
+    }
+    return stats();
+}
+
+// ============================================================================
+// C Allocation Tests
+// ============================================================================
+
+TEST(PreloadTest, MallocGoesThroughMemcpp) {
+    size_t before = preloaded_stats().allocations;
+    void* ptr = malloc(100);
+    ASSERT_NE(ptr, nullptr);
+    EXPECT_GE(malloc_usable_size(ptr), 100u);
+    EXPECT_GT(preloaded_stats().allocations, before);
+    free(ptr);
+}
+
+TEST(PreloadTest, CallocZeroesReusedMemory) {
+    void* dirty = malloc(256);
+    ASSERT_NE(dirty, nullptr);
+    memset(dirty, 0xAB, 256);
+    free(dirty);
+
+    unsigned char* ptr = (unsigned char*)calloc(16, 16);
+    ASSERT_NE(ptr, nullptr);
+    for(size_t i = 0; i < 256; i++) {
+        ASSERT_EQ(ptr[i], 0);
+    }
+    free(ptr);
+}
+
+TEST(PreloadTest, CallocOverflow) {
+    errno = 0;
+    volatile size_t count = SIZE_MAX / 2;
+    EXPECT_EQ(calloc(count, 3), nullptr);
+    EXPECT_EQ(errno, ENOMEM);
+}
+
+TEST(PreloadTest, ReallocKeepsContents) {
+    char* ptr = (char*)realloc(nullptr, 24);
+    ASSERT_NE(ptr, nullptr);
+    for(int i = 0; i < 24; i++) ptr[i] = (char)i;
+
+    ptr = (char*)realloc(ptr, 100000);
+    ASSERT_NE(ptr, nullptr);
+    for(int i = 0; i < 24; i++) {
+        EXPECT_EQ(ptr[i], (char)i);
+    }
+    ptr = (char*)realloc(ptr, 8);
+    ASSERT_NE(ptr, nullptr);
+    EXPECT_EQ(ptr[7], 7);
+    free(ptr);
+}
+
+TEST(PreloadTest, AlignedFunctions) {
+    for(size_t alignment = sizeof(void*); alignment <= 65536; alignment <<= 1) {
+        void* ptr = nullptr;
+        ASSERT_EQ(posix_memalign(&ptr, alignment, 100), 0);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % alignment, 0u);
+        free(ptr);
+
+        ptr = aligned_alloc(alignment, alignment * 2);
+        ASSERT_NE(ptr, nullptr);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % alignment, 0u);
+        free(ptr);
+    }
+
+    void* ptr = nullptr;
+    EXPECT_EQ(posix_memalign(&ptr, 24, 100), EINVAL);
+    EXPECT_EQ(posix_memalign(&ptr, 4, 100), EINVAL);
+
+    // memalign rounds up to a power of two
+    ptr = memalign(48, 100);
+    ASSERT_NE(ptr, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % 64, 0u);
+    free(ptr);
+
+    ptr = valloc(10);
+    ASSERT_NE(ptr, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % sysconf(_SC_PAGESIZE), 0u);
+    free(ptr);
+}
+
+// ============================================================================
+// Operator New Tests
+// ============================================================================
+
+struct alignas(256) OverAligned {
+    char data[300];
+};
+
+TEST(PreloadTest, NewAndDelete) {
+    size_t before = preloaded_stats().allocations;
+    std::vector<int>* vec = new std::vector<int>(1000, 7);
+    EXPECT_GE(preloaded_stats().allocations, before + 2);
+    delete vec;
+
+    OverAligned* objects = new OverAligned[3];
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(objects) % 256, 0u);
+    delete[] objects;
+
+    volatile size_t huge = SIZE_MAX - 4096;
+    EXPECT_THROW((void)::operator new(huge), std::bad_alloc);
+    EXPECT_EQ(::operator new(huge, std::nothrow), nullptr);
+}
+
+TEST(PreloadTest, SizedDelete) {
+    size_t before = preloaded_stats().frees;
+    void* ptr = ::operator new(40);
+    ::operator delete(ptr, 40);
+    ptr = ::operator new[](3000);
+    ::operator delete[](ptr, 3000);
+    ptr = ::operator new(100, std::align_val_t(64));
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % 64, 0u);
+    ::operator delete(ptr, 100, std::align_val_t(64));
+    EXPECT_EQ(preloaded_stats().frees, before + 3);
+
+    // C23 free_sized, not declared by this libc yet
+    auto free_sized = (void (*)(void*, size_t))dlsym(RTLD_DEFAULT, "free_sized");
+    ASSERT_NE(free_sized, nullptr);
+    free_sized(malloc(24), 24);
+}
+
+// ============================================================================
+// Thread and Fork Tests
+// ============================================================================
+
+// Blocks a thread still caches when it exits go back to the heap, or every
+// round would strand another thread's worth of them
+TEST(PreloadTest, ThreadExitReturnsCachedBlocks) {
+    auto held = [] {
+        mem_stats_t stats = preloaded_stats();
+        return stats.heap_bytes - stats.bytes_free;
+    };
+    size_t before = held();
+    for(int round = 0; round < 32; round++) {
+        std::thread([] {
+            std::vector<void*> ptrs;
+            for(int i = 0; i < 1000; i++) ptrs.push_back(malloc(16 + i % 200));
+            for(void* ptr : ptrs) free(ptr);
+        }).join();
+    }
+    EXPECT_LT(held(), before + 256 * 1024);
+}
+
+// The child must never find a lock held by a thread that fork left behind
+TEST(PreloadTest, ForkWhileAllocating) {
+    std::atomic<bool> done{false};
+    std::vector<std::thread> threads;
+    for(int t = 0; t < 4; t++) {
+        threads.emplace_back([&done, t] {
+            std::vector<void*> ptrs;
+            while(!done.load()) {
+                ptrs.push_back(malloc(16 + (ptrs.size() * 37 + t) % 5000));
+                if(ptrs.size() == 64) {
+                    for(void* ptr : ptrs) free(ptr);
+                    ptrs.clear();
+                }
+            }
+            for(void* ptr : ptrs) free(ptr);
+        });
+    }
+
+    for(int i = 0; i < 50; i++) {
+        pid_t pid = fork();
+        ASSERT_GE(pid, 0);
+        if(pid == 0) {
+            std::vector<void*> ptrs;
+            for(int j = 0; j < 1000; j++) ptrs.push_back(malloc(j * 13 % 70000));
+            for(void* ptr : ptrs) free(ptr);
+            _exit(0);
+        }
+        int status = 0;
+        ASSERT_EQ(waitpid(pid, &status, 0), pid);
+        EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    done.store(true);
+    for(auto& thread : threads) thread.join();
+}
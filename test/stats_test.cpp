@@ -0,0 +1,163 @@
+#include <gtest/gtest.h>
+#include "../include/alloc.hpp"
+#include "../include/stats.hpp"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+// Everything mem_dump_heap wrote to a temporary file
+static std::string dump_heap(DumpFormat format) {
+    FILE* file = tmpfile();
+    mem_dump_heap(fileno(file), format);
+    std::string out;
+    rewind(file);
+    char buffer[4096];
+    size_t n;
+    while((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        out.append(buffer, n);
+    }
+    fclose(file);
+    return out;
+}
+
+// ============================================================================
+// Counter Tests
+// ============================================================================
+
+TEST(StatsTest, CountsAllocationsAndFrees) {
+    mem_stats_t before = mem_stats();
+    void* ptr = mem_alloc(100);
+    ASSERT_NE(ptr, nullptr);
+
+    mem_stats_t during = mem_stats();
+    EXPECT_EQ(during.allocations, before.allocations + 1);
+    EXPECT_EQ(during.bytes_in_use, before.bytes_in_use + mem_usable_size(ptr));
+    EXPECT_EQ(during.histogram[mem_stats_bucket(100)], before.histogram[mem_stats_bucket(100)] + 1);
+
+    mem_free(ptr);
+    mem_stats_t after = mem_stats();
+    EXPECT_EQ(after.frees, before.frees + 1);
+    EXPECT_EQ(after.bytes_in_use, before.bytes_in_use);
+}
+
+TEST(StatsTest, HistogramBuckets) {
+    EXPECT_EQ(mem_stats_bucket(1), 0u);
+    EXPECT_EQ(mem_stats_bucket(SIZE_CLASS_MAX), (size_t)NUM_SIZE_CLASSES - 1);
+    EXPECT_EQ(mem_stats_bucket(SIZE_CLASS_MAX + 1), (size_t)NUM_SIZE_CLASSES);
+    EXPECT_EQ(mem_stats_bucket(4096), (size_t)NUM_SIZE_CLASSES + 2);
+    EXPECT_EQ(mem_stats_bucket(4097), (size_t)NUM_SIZE_CLASSES + 3);
+    EXPECT_EQ(mem_stats_bucket((size_t)-1), (size_t)MEM_STATS_BUCKETS - 1);
+
+    // Every size fits under the limit of its bucket
+    for(size_t size : {1, 24, 1016, 1017, 5000, 1 << 20}) {
+        EXPECT_LE(size, mem_stats_bucket_limit(mem_stats_bucket(size)));
+    }
+}
+
+TEST(StatsTest, ExitedThreadsStillCount) {
+    mem_stats_t before = mem_stats();
+    void* kept = nullptr;
+    std::thread worker([&kept]() {
+        for(int i = 0; i < 10; i++) {
+            mem_free(mem_alloc(2000));
+        }
+        kept = mem_alloc(3000);
+    });
+    worker.join();
+
+    mem_stats_t after = mem_stats();
+    EXPECT_EQ(after.allocations, before.allocations + 11);
+    EXPECT_EQ(after.frees, before.frees + 10);
+    EXPECT_EQ(after.bytes_in_use, before.bytes_in_use + mem_usable_size(kept));
+
+    // Freed by another thread than the one that allocated it
+    mem_free(kept);
+    EXPECT_EQ(mem_stats().bytes_in_use, before.bytes_in_use);
+}
+
+// ============================================================================
+// Heap Walk Tests
+// ============================================================================
+
+TEST(StatsTest, FragmentationOfInterleavedFrees) {
+    // Free every other block, none of the holes can merge
+    std::vector<void*> ptrs;
+    for(int i = 0; i < 64; i++) {
+        ptrs.push_back(mem_alloc(4000));
+    }
+    for(size_t i = 0; i < ptrs.size(); i += 2) {
+        mem_free(ptrs[i]);
+    }
+
+    mem_stats_t stats = mem_stats();
+    EXPECT_GE(stats.free_block_count, 32u);
+    EXPECT_GE(stats.block_count, 64u);
+    EXPECT_GE(stats.bytes_free, 32u * 4000);
+    EXPECT_LT(stats.largest_free_block, stats.bytes_free);
+    EXPECT_GT(stats.fragmentation, 0.0);
+    EXPECT_LT(stats.fragmentation, 1.0);
+    EXPECT_GT(stats.heap_bytes, stats.bytes_free);
+    EXPECT_GE(stats.growth_syscalls, 1u);
+
+    for(size_t i = 1; i < ptrs.size(); i += 2) {
+        mem_free(ptrs[i]);
+    }
+}
+
+TEST(StatsTest, CountsMmappedBlocks) {
+    mem_stats_t before = mem_stats();
+    void* large = mem_alloc(MEM_DEFAULT_MMAP_THRESHOLD * 2);
+    ASSERT_NE(large, nullptr);
+
+    mem_stats_t stats = mem_stats();
+    EXPECT_EQ(stats.block_count, before.block_count + 1);
+    EXPECT_GE(stats.mmap_bytes, before.mmap_bytes + MEM_DEFAULT_MMAP_THRESHOLD * 2);
+    mem_free(large);
+}
+
+TEST(StatsTest, DumpText) {
+    void* ptr = mem_alloc(2000);
+    void* large = mem_alloc(MEM_DEFAULT_MMAP_THRESHOLD * 2);
+    std::string dump = dump_heap(DUMP_TEXT);
+
+    EXPECT_NE(dump.find("heap "), std::string::npos);
+    EXPECT_NE(dump.find("segment "), std::string::npos);
+    EXPECT_NE(dump.find(" used"), std::string::npos);
+    EXPECT_NE(dump.find("mmapped:"), std::string::npos);
+
+    // Both blocks show up by their address
+    char address[32];
+    snprintf(address, sizeof(address), "%p ", ptr);
+    EXPECT_NE(dump.find(address), std::string::npos);
+    snprintf(address, sizeof(address), "%p ", large);
+    EXPECT_NE(dump.find(address), std::string::npos);
+
+    mem_free(ptr);
+    mem_free(large);
+}
+
+TEST(StatsTest, DumpJson) {
+    void* ptr = mem_alloc(2000);
+    void* large = mem_alloc(MEM_DEFAULT_MMAP_THRESHOLD * 2);
+    std::string dump = dump_heap(DUMP_JSON);
+
+    EXPECT_EQ(dump.front(), '{');
+    EXPECT_NE(dump.find("\"heaps\": ["), std::string::npos);
+    EXPECT_NE(dump.find("\"mmapped\": ["), std::string::npos);
+    EXPECT_NE(dump.find("\"free\": false"), std::string::npos);
+
+    // Brackets and braces balance
+    int depth = 0;
+    for(char c : dump) {
+        if(c == '{' || c == '[') depth++;
+        if(c == '}' || c == ']') depth--;
+        ASSERT_GE(depth, 0);
+    }
+    EXPECT_EQ(depth, 0);
+
+    mem_free(ptr);
+    mem_free(large);
+}